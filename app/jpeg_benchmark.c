@@ -0,0 +1,355 @@
+/*
+JPEG Encoder ベンチマーク
+合成画像（ノイズ、グラデーション、平坦、文字風、写真風）をVGA～8Kの解像度で生成し、
+jpeg_encoder_0～3（3はカーネルごと）のスループットと出力サイズをJSONで出力する
+jpeg_encoder_3はlibjpegencでメモリ上の画像をエンコードする時間を子プロセスの中で測り、
+単体版のjpeg_encoder_0～2は別プロセスで実行してプロセス全体の時間を測る（最大RSSはどちらも子プロセスの値）
+品質の意味は単体版とjpeg_encoder_3で異なるので、出力サイズは同じ意味の品質どうしでのみ比べられる
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "jpegenc.h"
+#include "jpeg_patterns.h"
+
+#define USAGE "Usage: %s [-n runs] [-q quality_scale] [-s sizes] [-i patterns] [-l legacy_mpixels] [-b bin_dir] [-w work_dir] [-o output.json]\n"
+
+// 解像度（幅・高さとも16の倍数。FHDは1080を1088に切り上げる）
+typedef struct {
+    const char* name;
+    int width;
+    int height;
+} BenchSize;
+
+static const BenchSize Sizes[] = {
+    { "vga", 640, 480 },
+    { "hd", 1280, 720 },
+    { "fhd", 1920, 1088 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+};
+
+// 測定対象（jpeg_encoder_3はカーネルごとに測定する）
+// 単体版は別プロセスで実行し、品質は量子化テーブルに掛ける倍率（quality_scale / 100、小さいほど高画質）
+// jpeg_encoder_3はlibjpegencを直接呼び、品質はIJGと同じ尺度（大きいほど高画質）
+typedef struct {
+    const char* binary;
+    const char* kernel;  // NULL: カーネル指定なし
+    int legacy;          // 1: 低速な単体版（legacy_mpixels以下の解像度のみ、別プロセスで測定）
+} BenchTarget;
+
+static const BenchTarget Targets[] = {
+    { "jpeg_encoder_0", NULL, 1 },
+    { "jpeg_encoder_1", NULL, 1 },
+    { "jpeg_encoder_2", NULL, 1 },
+    { "jpeg_encoder_3", "scalar", 0 },
+    { "jpeg_encoder_3", "sse4.1", 0 },
+    { "jpeg_encoder_3", "avx2", 0 },
+};
+
+// 1回の測定結果
+typedef struct {
+    double seconds;   // 最速の実行時間
+    long peakRSS;     // 子プロセスの最大RSS（KB）
+    long bytes;       // 出力サイズ
+} BenchResult;
+
+// 合成画像のBMPファイル（24bit、ボトムアップ）の書き出し
+// bgrはgeneratePatternで生成した画像（上の行から）
+int writeImage(const unsigned char* bgr, int width, int height, const char* fileName) {
+    FILE* fp = fopen(fileName, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot create file %s\n", fileName);
+        return 0;
+    }
+
+    int rowSize = (width * 3 + 3) & ~3;
+    unsigned char header[54] = { 'B', 'M' };
+    uint32_t fileSize = 54 + (uint32_t)rowSize * height;
+    uint32_t dataOffset = 54, infoSize = 40;
+    int32_t bmpWidth = width, bmpHeight = height;
+    uint16_t planes = 1, bitCount = 24;
+    memcpy(header + 2, &fileSize, 4);
+    memcpy(header + 10, &dataOffset, 4);
+    memcpy(header + 14, &infoSize, 4);
+    memcpy(header + 18, &bmpWidth, 4);
+    memcpy(header + 22, &bmpHeight, 4);
+    memcpy(header + 26, &planes, 2);
+    memcpy(header + 28, &bitCount, 2);
+
+    unsigned char* row = (unsigned char*)calloc(rowSize, 1);
+    int success = row && fwrite(header, 1, 54, fp) == 54;
+
+    for (int y = height - 1; success && y >= 0; y--) {
+        memcpy(row, bgr + (size_t)y * width * 3, (size_t)width * 3);
+        success = fwrite(row, 1, rowSize, fp) == (size_t)rowSize;
+    }
+
+    free(row);
+    if (fclose(fp) != 0) success = 0;
+    if (!success) fprintf(stderr, "Error: Failed to write file %s\n", fileName);
+    return success;
+}
+
+// エンコーダを別プロセスで1回実行し、実行時間と最大RSSを測る
+int runEncoder(char* const argv[], double* seconds, long* peakRSS) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) return 0;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    *peakRSS = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// 単体版をruns回実行し、最速の結果を返す（プロセスの起動とBMPの読み書きを含む）
+int benchmarkProcess(const BenchTarget* target, const char* binDir, const char* inputFile, const char* outputFile, int quality, int runs, BenchResult* result) {
+    char binary[4096], qualityText[16];
+    snprintf(binary, sizeof(binary), "%s/%s", binDir, target->binary);
+    snprintf(qualityText, sizeof(qualityText), "%d", quality);
+
+    char* argv[8];
+    int argc = 0;
+    argv[argc++] = binary;
+    if (target->kernel) {
+        argv[argc++] = (char*)"-k";
+        argv[argc++] = (char*)target->kernel;
+    }
+    argv[argc++] = (char*)inputFile;
+    argv[argc++] = (char*)outputFile;
+    argv[argc++] = qualityText;
+    argv[argc] = NULL;
+
+    result->seconds = 0;
+    result->peakRSS = 0;
+    for (int i = 0; i < runs; i++) {
+        double seconds;
+        long peakRSS;
+        if (!runEncoder(argv, &seconds, &peakRSS)) return 0;
+        if (i == 0 || seconds < result->seconds) result->seconds = seconds;
+        if (peakRSS > result->peakRSS) result->peakRSS = peakRSS;
+    }
+
+    struct stat st;
+    if (stat(outputFile, &st) != 0) return 0;
+    result->bytes = (long)st.st_size;
+    return 1;
+}
+
+// jpeg_encoder_3のエンコードをlibjpegencでruns回実行し、最速の結果を返す
+// 時間はメモリ上の画像をメモリ上のJPEGにするまでで、プロセスの起動とファイルの読み書きを含まない
+// カーネルは呼び出し元で選んでおく
+int encodeLibrary(const unsigned char* bgr, int width, int height, int quality, int runs, BenchResult* result) {
+    JpegEncoder* encoder = JpegEncoder_create();
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
+    int success = encoder && JpegEncoder_setQuality(encoder, quality);
+
+    result->seconds = 0;
+    result->peakRSS = 0;
+    for (int i = 0; success && i < runs; i++) {
+        struct timespec start, end;
+        sink.size = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        success = JpegEncoder_encode(encoder, bgr, width, height, width * 3, &sink);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+        if (i == 0 || seconds < result->seconds) result->seconds = seconds;
+    }
+    result->bytes = (long)sink.size;
+
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_destroy(encoder);
+    return success;
+}
+
+// encodeLibraryを子プロセスで実行し、時間と出力サイズをパイプで受け取る
+// 最大RSSは子プロセスの値（fork時に引き継いだ入力画像とベンチマーク自身の分を含む）
+int benchmarkLibrary(const unsigned char* bgr, int width, int height, int quality, int runs, BenchResult* result) {
+    int fds[2];
+    if (pipe(fds) != 0) return 0;
+    fflush(NULL);  // 子プロセスが出力バッファを二重に書き出さないようにする
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        BenchResult child;
+        int success = encodeLibrary(bgr, width, height, quality, runs, &child);
+        success = success && write(fds[1], &child, sizeof(child)) == (ssize_t)sizeof(child);
+        _exit(success ? 0 : 1);
+    }
+
+    close(fds[1]);
+    BenchResult child;
+    ssize_t received = read(fds[0], &child, sizeof(child));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return 0;
+    if (received != (ssize_t)sizeof(child) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return 0;
+
+    *result = child;
+    result->peakRSS = usage.ru_maxrss;
+    return 1;
+}
+
+// カンマ区切りの名前の一覧にnameが含まれるか（listがNULLならすべて）
+int selected(const char* list, const char* name) {
+    if (!list) return 1;
+    size_t length = strlen(name);
+    for (const char* p = list; *p;) {
+        const char* end = strchr(p, ',');
+        size_t itemLength = end ? (size_t)(end - p) : strlen(p);
+        if (itemLength == length && strncmp(p, name, length) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+// メインプログラム
+int main(int argc, char* argv[]) {
+    int runs = 3;
+    int quality = 75;
+    const char* sizeList = NULL;
+    const char* patternList = NULL;
+    double legacyMPixels = 0.5;  // 単体版はVGAのみ（1枚数秒かかるため）
+    const char* binDir = ".";
+    const char* workDir = "/tmp";
+    const char* outputFile = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:s:i:l:b:w:o:")) != -1) {
+        switch (opt) {
+        case 'n': runs = atoi(optarg); break;
+        case 'q': quality = atoi(optarg); break;
+        case 's': sizeList = optarg; break;
+        case 'i': patternList = optarg; break;
+        case 'l': legacyMPixels = atof(optarg); break;
+        case 'b': binDir = optarg; break;
+        case 'w': workDir = optarg; break;
+        case 'o': outputFile = optarg; break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || runs < 1 || quality < 1 || quality > 100) {
+        fprintf(stderr, USAGE, argv[0]);
+        return 1;
+    }
+
+    FILE* out = outputFile ? fopen(outputFile, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: Cannot create file %s\n", outputFile);
+        return 1;
+    }
+
+    char imageFile[4096], jpegFile[4096];
+    snprintf(imageFile, sizeof(imageFile), "%s/jpeg_benchmark_%d.bmp", workDir, (int)getpid());
+    snprintf(jpegFile, sizeof(jpegFile), "%s/jpeg_benchmark_%d.jpg", workDir, (int)getpid());
+
+    fprintf(out, "{\n  \"quality\": %d,\n  \"runs\": %d,\n", quality, runs);
+    fprintf(out, "  \"quality_semantics\": {\"linear_scale\": \"quantization tables multiplied by quality / 100, lower is better quality\", "
+                 "\"ijg\": \"IJG quality scaling, higher is better quality\", \"note\": \"bytes are only comparable between results with the same quality_semantics\"},\n");
+    fprintf(out, "  \"timing\": {\"whole_process\": \"fork/exec to exit, including BMP read and JPEG write\", "
+                 "\"in_process\": \"libjpegenc encode of an in-memory image to an in-memory sink, run in a forked child\", "
+                 "\"peak_rss_kb\": \"peak RSS of the child process; in_process children include the benchmark process and the input image\"},\n");
+    fprintf(out, "  \"results\": [");
+    int first = 1, failures = 0;
+
+    for (size_t s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++) {
+        const BenchSize* size = &Sizes[s];
+        if (!selected(sizeList, size->name)) continue;
+        double mpixels = (double)size->width * size->height / 1e6;
+        double mcuCount = (double)(size->width / 16) * (size->height / 16);
+
+        unsigned char* bgr = (unsigned char*)malloc((size_t)size->width * size->height * 3);
+        if (!bgr) {
+            fprintf(stderr, "Error: Cannot allocate %s image\n", size->name);
+            failures++;
+            continue;
+        }
+
+        for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+            if (!selected(patternList, PatternNames[pattern])) continue;
+            generatePattern(pattern, size->width, size->height, bgr);
+            int imageWritten = 0;
+
+            for (size_t t = 0; t < sizeof(Targets) / sizeof(Targets[0]); t++) {
+                const BenchTarget* target = &Targets[t];
+                const char* status = "ok";
+                BenchResult result;
+
+                if (target->legacy && mpixels > legacyMPixels) {
+                    status = "skipped";
+                } else if (target->legacy) {
+                    // 単体版はBMPファイルから読むので、画像ごとに一度だけ書き出す
+                    if (!imageWritten) imageWritten = writeImage(bgr, size->width, size->height, imageFile);
+                    if (!imageWritten || !benchmarkProcess(target, binDir, imageFile, jpegFile, quality, runs, &result)) {
+                        status = "failed";
+                        failures++;
+                    }
+                } else if (target->kernel && !JpegEncoder_initKernels(target->kernel)) {
+                    status = "unsupported";
+                } else if (!benchmarkLibrary(bgr, size->width, size->height, quality, runs, &result)) {
+                    status = "failed";
+                    failures++;
+                }
+
+                fprintf(out, "%s\n    {\"variant\": \"%s\", \"kernel\": \"%s\", \"pattern\": \"%s\", \"size\": \"%s\", "
+                        "\"width\": %d, \"height\": %d, \"quality_semantics\": \"%s\", \"timing\": \"%s\", \"status\": \"%s\"",
+                        first ? "" : ",", target->binary, target->kernel ? target->kernel : "default",
+                        PatternNames[pattern], size->name, size->width, size->height,
+                        target->legacy ? "linear_scale" : "ijg", target->legacy ? "whole_process" : "in_process", status);
+                if (strcmp(status, "ok") == 0) {
+                    fprintf(out, ", \"seconds\": %.6f, \"mpix_per_s\": %.2f, \"ns_per_mcu\": %.1f, \"bytes\": %ld",
+                            result.seconds, mpixels / result.seconds, result.seconds * 1e9 / mcuCount, result.bytes);
+                    fprintf(out, ", \"peak_rss_kb\": %ld", result.peakRSS);
+                }
+                fprintf(out, "}");
+                fflush(out);
+                first = 0;
+            }
+            if (imageWritten) remove(imageFile);
+        }
+        free(bgr);
+    }
+    remove(jpegFile);
+
+    fprintf(out, "\n  ]\n}\n");
+    if (outputFile) fclose(out);
+    return failures ? 1 : 0;
+}
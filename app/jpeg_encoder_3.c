@@ -1,582 +1,602 @@
 /*
 JEPG Encoder No.3
-4:4:4を4:2:0に変換版
+4:4:4を4:2:0に変換版（-cで4:2:2、4:4:4、グレースケールも選べる）
+（エンコーダ本体はjpegenc.c）
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "jpegenc.h"
+
+#define USAGE "Usage: %s [-d fast|ref] [-k scalar|sse4.1|avx2] [-r restart_interval] [-t threads] [-p segments|pipeline] [-c 420|422|444|gray] [-i format:WxH] [-m cache_mcus] [-f flat_threshold] [-s] [-o] [-b max_bytes] <input> <output.jpg> <quality>\n" \
+              "       %s -B [options] <manifest|input_dir> <output_dir> <quality>\n" \
+              "  quality: 1-100 on the IJG scale, higher is better (not the linear quality_scale of jpeg_encoder_0..2)\n" \
+              "  -i: raw frame input (format: bgr|bgrx|rgba|i420|nv12|yuyv), otherwise the input is a BMP file\n" \
+              "  -B: manifest lines are <input>[<TAB><output>]; paths may contain spaces, lines starting with # are skipped\n"
+
+// エンコードの設定（コマンドラインオプション）
+typedef struct {
+    int dctMethod;
+    int quality;
+    int restartInterval;
+    int threadCount;
+    int parallelMode;
+    int subsampling;
+    int flatThreshold;
+    int optimize;
+    int streaming;
+    long maxBytes;  // 0: 品質を指定してエンコード
+    int rawFormat;  // 生のフレームの画素形式（-1: BMPファイル）
+    int rawWidth;
+    int rawHeight;
+    int cacheEntries;  // エンコード済みMCUのキャッシュの項目数（0: 使わない）
+} EncodeOptions;
+
+// バッチエンコードの1ファイル分
+typedef struct {
+    char* inputFile;
+    char* outputFile;
+    long pixels;  // エンコードした画素数（失敗なら0）
+} BatchItem;
 
-#define PI 3.1415926f
+// ワーカーごとの作業キュー（両端キュー）
+// 持ち主は先頭から取り出し、他のワーカーは末尾から盗む
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int tail;  // [head, tail)が未処理のBatchItemの番号
+} WorkQueue;
 
-// 構造体定義
 typedef struct {
-    int length;
-    int value;
-} BitString;
+    BatchItem* items;
+    int itemCount;
+    WorkQueue* queues;
+    int workerCount;
+    const EncodeOptions* options;
+} Batch;
 
 typedef struct {
-    int width;
-    int height;
-    unsigned char* rgbBuffer;
-    unsigned char YTable[64];
-    unsigned char CbCrTable[64];
-    BitString Y_DC_Huffman_Table[12];
-    BitString Y_AC_Huffman_Table[256];
-    BitString CbCr_DC_Huffman_Table[12];
-    BitString CbCr_AC_Huffman_Table[256];
-} JpegEncoder;
-
-// 定数テーブル
-static const unsigned char Luminance_Quantization_Table[64] = {
-    16, 11, 10, 16, 24, 40, 51, 61,
-    12, 12, 14, 19, 26, 58, 60, 55,
-    14, 13, 16, 24, 40, 57, 69, 56,
-    14, 17, 22, 29, 51, 87, 80, 62,
-    18, 22, 37, 56, 68, 109, 103, 77,
-    24, 35, 55, 64, 81, 104, 113, 92,
-    49, 64, 78, 87, 103, 121, 120, 101,
-    72, 92, 95, 98, 112, 100, 103, 99
-};
-
-static const unsigned char Chrominance_Quantization_Table[64] = {
-    17, 18, 24, 47, 99, 99, 99, 99,
-    18, 21, 26, 66, 99, 99, 99, 99,
-    24, 26, 56, 99, 99, 99, 99, 99,
-    47, 66, 99, 99, 99, 99, 99, 99,
-    99, 99, 99, 99, 99, 99, 99, 99,
-    99, 99, 99, 99, 99, 99, 99, 99,
-    99, 99, 99, 99, 99, 99, 99, 99,
-    99, 99, 99, 99, 99, 99, 99, 99
-};
-
-static const char ZigZag[64] = {
-    0, 1, 5, 6, 14, 15, 27, 28,
-    2, 4, 7, 13, 16, 26, 29, 42,
-    3, 8, 12, 17, 25, 30, 41, 43,
-    9, 11, 18, 24, 31, 40, 44, 53,
-    10, 19, 23, 32, 39, 45, 52, 54,
-    20, 22, 33, 38, 46, 51, 55, 60,
-    21, 34, 37, 47, 50, 56, 59, 61,
-    35, 36, 48, 49, 57, 58, 62, 63
-};
-
-static const char Standard_DC_Luminance_NRCodes[] = { 0, 0, 7, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
-static const unsigned char Standard_DC_Luminance_Values[] = { 4, 5, 3, 2, 6, 1, 0, 7, 8, 9, 10, 11 };
-
-static const char Standard_DC_Chrominance_NRCodes[] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
-static const unsigned char Standard_DC_Chrominance_Values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
-
-static const char Standard_AC_Luminance_NRCodes[] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
-static const unsigned char Standard_AC_Luminance_Values[] = {
-    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
-    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
-    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
-    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
-    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
-    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
-    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
-    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
-    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
-    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-    0xf9, 0xfa
-};
-
-static const char Standard_AC_Chrominance_NRCodes[] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
-static const unsigned char Standard_AC_Chrominance_Values[] = {
-    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
-    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
-    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
-    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
-    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
-    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
-    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
-    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
-    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
-    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
-    0xf9, 0xfa
-};
-
-// コサインテーブル
-static const int16_t cos_table[8][8] = {
-    {16384, 16069, 15137, 13573, 11585, 9102, 6270, 3196},
-    {16384, 13573, 6270, -3196, -11585, -16069, -15137, -9102},
-    {16384, 9102, -6270, -16069, -11585, 3196, 15137, 13573},
-    {16384, 3196, -15137, -9102, 11585, 13573, -6270, -16069},
-    {16384, -3196, -15137, 9102, 11585, -13573, -6270, 16069},
-    {16384, -9102, -6270, 16069, -11585, -3196, 15137, -13573},
-    {16384, -13573, 6270, 3196, -11585, 16069, -15137, 9102},
-    {16384, -16069, 15137, -13573, 11585, -9102, 6270, -3196}
-};
-
-// 関数プロトタイプ
-int JpegEncoder_readFromBMP(JpegEncoder* encoder, const char* fileName);
-int JpegEncoder_encodeToJPG(JpegEncoder* encoder, const char* fileName, int quality_scale);
-void JpegEncoder_computeHuffmanTable(const char* nr_codes, const unsigned char* std_table, BitString* huffman_table);
-BitString JpegEncoder_getBitCode(int value);
-void JpegEncoder_write_byte(unsigned char value, FILE* fp);
-void JpegEncoder_write_word(unsigned short value, FILE* fp);
-void JpegEncoder_write(const void* p, int byteSize, FILE* fp);
-void JpegEncoder_doHuffmanEncoding(const short* DU, short* prevDC, const BitString* HTDC, const BitString* HTAC, BitString* outputBitString, int* bitStringCounts);
-void JpegEncoder_write_bitstring(const BitString* bs, int counts, int* newByte, int* newBytePos, FILE* fp);
-void JpegEncoder_convertColorSpace(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int width, int xPos, int yPos);
-void JpegEncoder_foword_FDC(const char* channel_data, short* fdc_data, const unsigned char* quant_table);
-void JpegEncoder_DCT(const char* channel_data, int64_t* dct_data);
-void JpegEncoder_Quantize(const int64_t* dct_data, short* quant_data, const unsigned char* quant_table);
-void JpegEncoder_ZigZag(const short* quant_data, short* fdc_data);
-void JpegEncoder_write_jpeg_header(JpegEncoder* encoder, FILE* fp);
-
-// BMPファイルの読み込み
-int JpegEncoder_readFromBMP(JpegEncoder* encoder, const char* fileName) {
-    // BMPファイルヘッダ構造体
-    #pragma pack(push, 2)
-    typedef struct {
-        unsigned short bfType;
-        unsigned int bfSize;
-        unsigned short bfReserved1;
-        unsigned short bfReserved2;
-        unsigned int bfOffBits;
-    } BITMAPFILEHEADER;
-
-    typedef struct {
-        unsigned int biSize;
-        int biWidth;
-        int biHeight;
-        unsigned short biPlanes;
-        unsigned short biBitCount;
-        unsigned int biCompression;
-        unsigned int biSizeImage;
-        int biXPelsPerMeter;
-        int biYPelsPerMeter;
-        unsigned int biClrUsed;
-        unsigned int biClrImportant;
-    } BITMAPINFOHEADER;
-    #pragma pack(pop)
-
-    FILE* fp = fopen(fileName, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open file %s\n", fileName);
+    Batch* batch;
+    int index;
+    pthread_t thread;
+    int started;  // 1: threadを作成した
+    JpegEncoder_MCUCacheStats cacheStats;  // ワーカーのエンコーダのMCUキャッシュの集計
+} BatchWorker;
+
+// 入力ファイルの読み込み（BMPファイル、または-iで指定した生のフレーム）
+int readInput(const EncodeOptions* options, const char* inputFile, JpegEncoder_Image* image, JpegEncoder_Frame* frame) {
+    if (options->rawFormat >= 0) {
+        if (!JpegEncoder_readRawFrame(image, frame, inputFile, options->rawFormat, options->rawWidth, options->rawHeight)) {
+            fprintf(stderr, "Error: Failed to read raw frame %s\n", inputFile);
+            return 0;
+        }
+        return 1;
+    }
+    if (!JpegEncoder_readFromBMP(image, inputFile)) {
+        fprintf(stderr, "Error: Failed to read BMP file %s\n", inputFile);
         return 0;
     }
+    JpegEncoder_bgrFrame(frame, image->data, image->width, image->height, image->stride);
+    return 1;
+}
 
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
-    int success = 0;
-
-    do {
-        if (fread(&fileHeader, sizeof(fileHeader), 1, fp) != 1) break;
-        if (fileHeader.bfType != 0x4D42) break;
-
-        if (fread(&infoHeader, sizeof(infoHeader), 1, fp) != 1) break;
-        if (infoHeader.biBitCount != 24 || infoHeader.biCompression != 0) break;
-
-        int width = infoHeader.biWidth;
-        int height = infoHeader.biHeight < 0 ? (-infoHeader.biHeight) : infoHeader.biHeight;
-        if ((width & 15) != 0 || (height & 15) != 0) break;
+// 画像全体を読み込んでからエンコード
+int encodeImage(JpegEncoder* encoder, const EncodeOptions* options, const char* inputFile, const char* outputFile, long* pixels) {
+    JpegEncoder_Image image;
+    JpegEncoder_Frame frame;
+    if (!readInput(options, inputFile, &image, &frame)) return 0;
 
-        int bmpSize = width * height * 3;
-        unsigned char* buffer = (unsigned char*)malloc(bmpSize);
-        if (!buffer) break;
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
 
-        fseek(fp, fileHeader.bfOffBits, SEEK_SET);
+    int success = JpegEncoder_encodeFrame(encoder, &frame, &sink) &&
+                  JpegEncoder_writeSink(&sink, outputFile);
+    *pixels = (long)image.width * image.height;
 
-        if (infoHeader.biHeight > 0) {
-            for (int i = 0; i < height; i++) {
-                if (fread(buffer + (height - 1 - i) * width * 3, 3, width, fp) != width) {
-                    free(buffer);
-                    break;
-                }
-            }
-        } else {
-            if (fread(buffer, 3, width * height, fp) != width * height) {
-                free(buffer);
-                break;
-            }
-        }
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_freeImage(&image);
+    return success;
+}
 
-        encoder->rgbBuffer = buffer;
-        encoder->width = width;
-        encoder->height = height;
-        success = 1;
-    } while (0);
+// DCT係数を一度だけ求め、max_bytes以下に収まる最も高い品質でエンコード
+int encodeToSize(JpegEncoder* encoder, const EncodeOptions* options, const char* inputFile, const char* outputFile, size_t maxBytes, long* pixels) {
+    JpegEncoder_Image image;
+    JpegEncoder_Frame frame;
+    if (!readInput(options, inputFile, &image, &frame)) return 0;
+
+    JpegEncoder_Coefficients* coefficients = JpegEncoder_analyzeFrame(encoder, &frame);
+    *pixels = (long)image.width * image.height;
+    JpegEncoder_freeImage(&image);
+    if (!coefficients) return 0;
+
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
+
+    int quality = 0;
+    int success = JpegEncoder_encodeToSize(encoder, coefficients, maxBytes, &sink, &quality) &&
+                  JpegEncoder_writeSink(&sink, outputFile);
+    if (success) {
+        printf("Selected quality %d for %s (%zu bytes)\n", quality, outputFile, sink.size);  // バッチでは複数のワーカーが出力する
+    }
 
-    fclose(fp);
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_freeCoefficients(coefficients);
     return success;
 }
 
-// JPEGエンコーディング
-int JpegEncoder_encodeToJPG(JpegEncoder* encoder, const char* fileName, int quality_scale) {
-    if (!encoder->rgbBuffer || encoder->width == 0 || encoder->height == 0) {
-        fprintf(stderr, "Error: No image data to encode\n");
+// 16行ずつ読み込みながらエンコードし、ストリップごとにファイルへ書き出す
+int encodeStream(JpegEncoder* encoder, const char* inputFile, const char* outputFile, long* pixels) {
+    JpegEncoder_BMPStream stream;
+    if (!JpegEncoder_openBMPStream(&stream, inputFile)) {
+        fprintf(stderr, "Error: Failed to read BMP file %s\n", inputFile);
         return 0;
     }
 
-    FILE* fp = fopen(fileName, "wb");
-    if (!fp) {
-        fprintf(stderr, "Error: Cannot open output file %s\n", fileName);
+    int fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", outputFile);
+        JpegEncoder_closeBMPStream(&stream);
         return 0;
     }
 
-    JpegEncoder_write_jpeg_header(encoder, fp);
-
-    short prev_DC_Y = 0, prev_DC_Cb = 0, prev_DC_Cr = 0;
-    int newByte = 0, newBytePos = 7;
-
-    for (int yPos = 0; yPos < encoder->height; yPos += 16) { // 16x16マクロブロック
-        for (int xPos = 0; xPos < encoder->width; xPos += 16) {
-            char yData[4][64], cbData[64], crData[64]; // 4つのYブロック、1つのCb/Crブロック
-            short yQuant[4][64], cbQuant[64], crQuant[64];
-            BitString outputBitString[128];
-            int bitStringCounts;
-
-            // 色空間変換（4つのYブロック、1つのCb/Crブロック）
-            JpegEncoder_convertColorSpace(encoder->rgbBuffer, yData[0], cbData, crData, encoder->width, xPos, yPos);
+    unsigned char* strip = (unsigned char*)malloc((size_t)stream.width * 3 * 16);
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
 
-            // Yチャンネル（4ブロック）
-            for (int i = 0; i < 4; i++) {
-                JpegEncoder_foword_FDC(yData[i], yQuant[i], encoder->YTable);
-                JpegEncoder_doHuffmanEncoding(yQuant[i], &prev_DC_Y, encoder->Y_DC_Huffman_Table, encoder->Y_AC_Huffman_Table, outputBitString, &bitStringCounts);
-                JpegEncoder_write_bitstring(outputBitString, bitStringCounts, &newByte, &newBytePos, fp);
-            }
+    int success = strip && JpegEncoder_beginStream(encoder, stream.width, stream.height, &sink);
+    for (int yPos = 0; success && yPos < stream.height; yPos += 16) {
+        success = JpegEncoder_readBMPStrip(&stream, yPos, 16, strip) &&
+                  JpegEncoder_writeStrip(encoder, strip, stream.width * 3, &sink) &&
+                  JpegEncoder_drainSink(&sink, fd);
+    }
+    success = success && JpegEncoder_endStream(encoder, &sink) && JpegEncoder_drainSink(&sink, fd);
+    *pixels = (long)stream.width * stream.height;
 
-            // Cbチャンネル（1ブロック）
-            JpegEncoder_foword_FDC(cbData, cbQuant, encoder->CbCrTable);
-            JpegEncoder_doHuffmanEncoding(cbQuant, &prev_DC_Cb, encoder->CbCr_DC_Huffman_Table, encoder->CbCr_AC_Huffman_Table, outputBitString, &bitStringCounts);
-            JpegEncoder_write_bitstring(outputBitString, bitStringCounts, &newByte, &newBytePos, fp);
+    JpegEncoder_freeSink(&sink);
+    free(strip);
+    close(fd);
+    JpegEncoder_closeBMPStream(&stream);
+    return success;
+}
 
-            // Crチャンネル（1ブロック）
-            JpegEncoder_foword_FDC(crData, crQuant, encoder->CbCrTable);
-            JpegEncoder_doHuffmanEncoding(crQuant, &prev_DC_Cr, encoder->CbCr_DC_Huffman_Table, encoder->CbCr_AC_Huffman_Table, outputBitString, &bitStringCounts);
-            JpegEncoder_write_bitstring(outputBitString, bitStringCounts, &newByte, &newBytePos, fp);
-        }
+// エンコーダの作成と設定
+JpegEncoder* createEncoder(const EncodeOptions* options) {
+    JpegEncoder* encoder = JpegEncoder_create();
+    if (!encoder) return NULL;
+
+    JpegEncoder_setDCTMethod(encoder, options->dctMethod);
+    JpegEncoder_setQuality(encoder, options->quality);
+    JpegEncoder_setOptimizeHuffman(encoder, options->optimize);
+    JpegEncoder_setParallelMode(encoder, options->parallelMode);
+    if (!JpegEncoder_setSubsampling(encoder, options->subsampling) ||
+        !JpegEncoder_setFlatBlockThreshold(encoder, options->flatThreshold) ||
+        !JpegEncoder_setRestartInterval(encoder, options->restartInterval) ||
+        !JpegEncoder_setThreadCount(encoder, options->threadCount) ||
+        !JpegEncoder_setMCUCache(encoder, options->cacheEntries)) {
+        JpegEncoder_destroy(encoder);
+        return NULL;
     }
+    return encoder;
+}
 
-    if (newBytePos != 7) {
-        JpegEncoder_write_byte((unsigned char)newByte, fp);
+// 1ファイルのエンコード（成功すると*pixelsに画素数を返す）
+int encodeFile(JpegEncoder* encoder, const EncodeOptions* options, const char* inputFile, const char* outputFile, long* pixels) {
+    *pixels = 0;
+    int success = options->maxBytes > 0 ? encodeToSize(encoder, options, inputFile, outputFile, (size_t)options->maxBytes, pixels)
+                : options->streaming ? encodeStream(encoder, inputFile, outputFile, pixels)
+                                     : encodeImage(encoder, options, inputFile, outputFile, pixels);
+    if (!success) {
+        fprintf(stderr, "Error: Failed to encode to JPEG file %s\n", outputFile);
+        *pixels = 0;
     }
+    return success;
+}
 
-    JpegEncoder_write_word(0xFFD9, fp); // EOIマーカー
-    fclose(fp);
-    return 1;
+// MCUキャッシュのヒット率の表示
+void printCacheStats(const JpegEncoder_MCUCacheStats* stats) {
+    size_t lookups = stats->hits + stats->misses;
+    printf("MCU cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions, %d entries\n",
+           stats->hits, stats->misses, lookups > 0 ? 100.0 * stats->hits / lookups : 0.0, stats->evictions, stats->entries);
 }
 
-// ハフマンテーブルの計算
-void JpegEncoder_computeHuffmanTable(const char* nr_codes, const unsigned char* std_table, BitString* huffman_table) {
-    unsigned char pos_in_table = 0;
-    unsigned short code_value = 0;
-
-    for (int k = 1; k <= 16; k++) {
-        for (int j = 1; j <= nr_codes[k - 1]; j++) {
-            huffman_table[std_table[pos_in_table]].value = code_value;
-            huffman_table[std_table[pos_in_table]].length = k;
-            pos_in_table++;
-            code_value++;
+// 作業キューから次のファイルを取り出す
+// 自分のキューが空なら、他のワーカーのキューの末尾から盗む
+int takeBatchItem(Batch* batch, int worker) {
+    for (int i = 0; i < batch->workerCount; i++) {
+        int victim = (worker + i) % batch->workerCount;
+        WorkQueue* queue = &batch->queues[victim];
+        int item = -1;
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail) {
+            item = victim == worker ? queue->head++ : --queue->tail;
         }
-        code_value <<= 1;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (item >= 0) return item;
     }
+    return -1;
 }
 
-// ビットコードの取得
-BitString JpegEncoder_getBitCode(int value) {
-    BitString ret;
-    int v = (value > 0) ? value : -value;
-    int length = 0;
-    for (length = 0; v; v >>= 1) length++;
+// バッチエンコードのワーカー（エンコーダはワーカーごとに1つ作り、全ファイルで使い回す）
+void* batchWorker(void* arg) {
+    BatchWorker* worker = (BatchWorker*)arg;
+    Batch* batch = worker->batch;
 
-    ret.value = value > 0 ? value : ((1 << length) + value - 1);
-    ret.length = length;
-    return ret;
-}
+    JpegEncoder* encoder = createEncoder(batch->options);
+    if (!encoder) return NULL;
 
-// バイト書き込み
-void JpegEncoder_write_byte(unsigned char value, FILE* fp) {
-    fwrite(&value, 1, 1, fp);
-}
+    for (int item; (item = takeBatchItem(batch, worker->index)) >= 0;) {
+        BatchItem* entry = &batch->items[item];
+        encodeFile(encoder, batch->options, entry->inputFile, entry->outputFile, &entry->pixels);
+    }
 
-// ワード書き込み
-void JpegEncoder_write_word(unsigned short value, FILE* fp) {
-    unsigned short _value = ((value >> 8) & 0xFF) | ((value & 0xFF) << 8);
-    fwrite(&_value, 2, 1, fp);
+    JpegEncoder_getMCUCacheStats(encoder, &worker->cacheStats);
+    JpegEncoder_destroy(encoder);
+    return NULL;
 }
 
-// 汎用書き込み
-void JpegEncoder_write(const void* p, int byteSize, FILE* fp) {
-    fwrite(p, 1, byteSize, fp);
+// 出力ファイル名（出力ディレクトリ/入力ファイル名の拡張子を.jpgにしたもの）
+char* makeOutputPath(const char* outputDir, const char* inputFile) {
+    const char* name = strrchr(inputFile, '/');
+    name = name ? name + 1 : inputFile;
+    const char* ext = strrchr(name, '.');
+    int nameLength = ext ? (int)(ext - name) : (int)strlen(name);
+
+    size_t size = strlen(outputDir) + nameLength + 6;
+    char* path = (char*)malloc(size);
+    if (path) snprintf(path, size, "%s/%.*s.jpg", outputDir, nameLength, name);
+    return path;
 }
 
-// ハフマン符号化
-void JpegEncoder_doHuffmanEncoding(const short* DU, short* prevDC, const BitString* HTDC, const BitString* HTAC, BitString* outputBitString, int* bitStringCounts) {
-    BitString EOB = HTAC[0x00];
-    BitString SIXTEEN_ZEROS = HTAC[0xF0];
-    int index = 0;
-
-    // DC係数の符号化
-    int dcDiff = (int)(DU[0] - *prevDC);
-    *prevDC = DU[0];
-
-    if (dcDiff == 0) {
-        outputBitString[index++] = HTDC[0];
-    } else {
-        BitString bs = JpegEncoder_getBitCode(dcDiff);
-        outputBitString[index++] = HTDC[bs.length];
-        outputBitString[index++] = bs;
+// バッチにファイルを追加（outputFileがNULLなら出力ディレクトリに置く）
+int addBatchItem(Batch* batch, int* capacity, const char* inputFile, const char* outputFile, const char* outputDir) {
+    if (batch->itemCount == *capacity) {
+        int newCapacity = *capacity ? *capacity * 2 : 64;
+        BatchItem* items = (BatchItem*)realloc(batch->items, sizeof(BatchItem) * newCapacity);
+        if (!items) return 0;
+        batch->items = items;
+        *capacity = newCapacity;
     }
 
-    // AC係数の符号化
-    int endPos = 63;
-    while (endPos > 0 && DU[endPos] == 0) endPos--;
-
-    for (int i = 1; i <= endPos;) {
-        int startPos = i;
-        while (DU[i] == 0 && i <= endPos) i++;
+    BatchItem* item = &batch->items[batch->itemCount];
+    item->inputFile = strdup(inputFile);
+    item->outputFile = outputFile ? strdup(outputFile) : makeOutputPath(outputDir, inputFile);
+    item->pixels = 0;
+    if (!item->inputFile || !item->outputFile) {
+        free(item->inputFile);
+        free(item->outputFile);
+        return 0;
+    }
+    batch->itemCount++;
+    return 1;
+}
 
-        int zeroCounts = i - startPos;
-        if (zeroCounts >= 16) {
-            for (int j = 1; j <= zeroCounts / 16; j++)
-                outputBitString[index++] = SIXTEEN_ZEROS;
-            zeroCounts = zeroCounts % 16;
-        }
+int compareBatchItems(const void* a, const void* b) {
+    return strcmp(((const BatchItem*)a)->inputFile, ((const BatchItem*)b)->inputFile);
+}
 
-        BitString bs = JpegEncoder_getBitCode(DU[i]);
-        outputBitString[index++] = HTAC[(zeroCounts << 4) | bs.length];
-        outputBitString[index++] = bs;
-        i++;
+// ディレクトリ内の.bmpファイルの一覧（ファイル名順）
+int listDirectory(Batch* batch, const char* inputDir, const char* outputDir) {
+    DIR* dir = opendir(inputDir);
+    if (!dir) {
+        fprintf(stderr, "Error: Cannot open directory %s\n", inputDir);
+        return 0;
     }
 
-    if (endPos != 63) {
-        outputBitString[index++] = EOB;
+    int capacity = 0, success = 1;
+    struct dirent* entry;
+    while (success && (entry = readdir(dir)) != NULL) {
+        const char* ext = strrchr(entry->d_name, '.');
+        if (!ext || strlen(ext) != 4 || tolower((unsigned char)ext[1]) != 'b' ||
+            tolower((unsigned char)ext[2]) != 'm' || tolower((unsigned char)ext[3]) != 'p') continue;
+
+        size_t size = strlen(inputDir) + strlen(entry->d_name) + 2;
+        char* path = (char*)malloc(size);
+        if (!path) {
+            success = 0;
+            break;
+        }
+        snprintf(path, size, "%s/%s", inputDir, entry->d_name);
+        success = addBatchItem(batch, &capacity, path, NULL, outputDir);
+        free(path);
     }
+    closedir(dir);
 
-    *bitStringCounts = index;
+    if (success) qsort(batch->items, batch->itemCount, sizeof(BatchItem), compareBatchItems);
+    return success;
 }
 
-// ビットストリーム書き込み
-void JpegEncoder_write_bitstring(const BitString* bs, int counts, int* newByte, int* newBytePos, FILE* fp) {
-    static const unsigned short mask[] = {1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768};
+// マニフェストの読み込み
+// 1行に1ファイルで、"入力ファイル<TAB>出力ファイル"の形式（出力ファイルとタブは省略できる）
+// パスに空白を含められるように、区切りはタブだけにする（空行と#で始まる行は無視する）
+int readManifest(Batch* batch, const char* manifestFile, const char* outputDir) {
+    FILE* fp = fopen(manifestFile, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open manifest %s\n", manifestFile);
+        return 0;
+    }
 
-    for (int i = 0; i < counts; i++) {
-        int value = bs[i].value;
-        int posval = bs[i].length - 1;
+    int capacity = 0, success = 1, lineNumber = 0;
+    char line[4096];
+    while (success && fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof(fp)) {
+            fprintf(stderr, "Error: Line %d of manifest %s is too long\n", lineNumber, manifestFile);
+            success = 0;
+            break;
+        }
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length == 0 || line[0] == '#') continue;
 
-        while (posval >= 0) {
-            if ((value & mask[posval]) != 0) {
-                *newByte |= mask[*newBytePos];
-            }
-            posval--;
-            (*newBytePos)--;
-            if (*newBytePos < 0) {
-                JpegEncoder_write_byte((unsigned char)(*newByte), fp);
-                if (*newByte == 0xFF) {
-                    JpegEncoder_write_byte(0x00, fp);
-                }
-                *newBytePos = 7;
-                *newByte = 0;
-            }
+        char* outputFile = strchr(line, '\t');
+        if (outputFile) {
+            *outputFile++ = '\0';
+            if (*outputFile == '\0') outputFile = NULL;
+        }
+        if (line[0] == '\0') {
+            fprintf(stderr, "Error: Line %d of manifest %s has no input file\n", lineNumber, manifestFile);
+            success = 0;
+            break;
         }
+        success = addBatchItem(batch, &capacity, line, outputFile, outputDir);
     }
+    fclose(fp);
+    return success;
 }
 
-// 色空間変換
-void JpegEncoder_convertColorSpace(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int width, int xPos, int yPos) {
-    // Yは各8x8ブロックごとに計算（4ブロック）
-    for (int blockY = 0; blockY < 2; blockY++) {
-        for (int blockX = 0; blockX < 2; blockX++) {
-            char* yBlock = yData + (blockY * 2 + blockX) * 64;
-            for (int y = 0; y < 8; y++) {
-                const unsigned char* p = rgbBuffer + (yPos + blockY * 8 + y) * width * 3 + (xPos + blockX * 8) * 3;
-                for (int x = 0; x < 8; x++) {
-                    unsigned char B = *p++;
-                    unsigned char G = *p++;
-                    unsigned char R = *p++;
-                    yBlock[y * 8 + x] = (char)(((76 * R + 150 * G + 29 * B) >> 8) - 128);
-                }
-            }
-        }
+// バッチエンコード
+// 各ワーカーに連続したファイルを割り当て、先に終わったワーカーは他のワーカーから盗む
+int encodeBatch(const EncodeOptions* options, const char* input, const char* outputDir, int workerCount) {
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.options = options;
+
+    struct stat st;
+    int listed = stat(input, &st) == 0 && S_ISDIR(st.st_mode) ? listDirectory(&batch, input, outputDir)
+                                                                : readManifest(&batch, input, outputDir);
+    if (!listed) {
+        fprintf(stderr, "Error: Cannot read the list of input files\n");
     }
 
-    // CbとCrは16x16ピクセルから8x8ブロックを生成（2x2ピクセルの平均）
-    for (int y = 0; y < 8; y++) {
-        for (int x = 0; x < 8; x++) {
-            int cbSum = 0, crSum = 0;
-            // 2x2ピクセルの平均
-            for (int dy = 0; dy < 2; dy++) {
-                for (int dx = 0; dx < 2; dx++) {
-                    const unsigned char* p = rgbBuffer + (yPos + y * 2 + dy) * width * 3 + (xPos + x * 2 + dx) * 3;
-                    unsigned char B = *p++;
-                    unsigned char G = *p++;
-                    unsigned char R = *p++;
-                    cbSum += (-43 * R - 85 * G + 128 * B) >> 8;
-                    crSum += (128 * R - 107 * G - 21 * B) >> 8;
-                }
-            }
-            cbData[y * 8 + x] = (char)(cbSum / 4);
-            crData[y * 8 + x] = (char)(crSum / 4);
+    if (workerCount > batch.itemCount) workerCount = batch.itemCount > 0 ? batch.itemCount : 1;
+    batch.workerCount = workerCount;
+    batch.queues = (WorkQueue*)malloc(sizeof(WorkQueue) * workerCount);
+    BatchWorker* workers = (BatchWorker*)malloc(sizeof(BatchWorker) * workerCount);
+    if (!batch.queues || !workers) listed = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (listed) {
+        for (int i = 0; i < workerCount; i++) {
+            pthread_mutex_init(&batch.queues[i].lock, NULL);
+            batch.queues[i].head = (int)((long)batch.itemCount * i / workerCount);
+            batch.queues[i].tail = (int)((long)batch.itemCount * (i + 1) / workerCount);
+            workers[i].batch = &batch;
+            workers[i].index = i;
+            workers[i].started = 0;
+            memset(&workers[i].cacheStats, 0, sizeof(workers[i].cacheStats));
         }
-    }
-}
 
-// DCT処理
-void JpegEncoder_DCT(const char* channel_data, int64_t* dct_data) {
-    for (int v = 0; v < 8; v++) {
-        for (int u = 0; u < 8; u++) {
-            int64_t temp = 0;
-            for (int x = 0; x < 8; x++) {
-                for (int y = 0; y < 8; y++) {
-                    int64_t data = channel_data[y * 8 + x];
-                    data = (data * cos_table[x][u] + (1 << (14 - 1))) >> 14;
-                    data = (data * cos_table[y][v] + (1 << (14 - 1))) >> 14;
-                    temp += data;
-                }
-            }
-            dct_data[v * 8 + u] = temp;
+        // 呼び出し元のスレッドはワーカー0として働く
+        // スレッドを作れなかったワーカーの分は、他のワーカーが盗んで処理する
+        for (int i = 1; i < workerCount; i++) {
+            workers[i].started = pthread_create(&workers[i].thread, NULL, batchWorker, &workers[i]) == 0;
+        }
+        batchWorker(&workers[0]);
+        for (int i = 1; i < workerCount; i++) {
+            if (workers[i].started) pthread_join(workers[i].thread, NULL);
+        }
+        for (int i = 0; i < workerCount; i++) {
+            pthread_mutex_destroy(&batch.queues[i].lock);
         }
     }
-}
 
-// 量子化処理
-void JpegEncoder_Quantize(const int64_t* dct_data, short* quant_data, const unsigned char* quant_table) {
-    for (int v = 0; v < 8; v++) {
-        for (int u = 0; u < 8; u++) {
-            int alpha_u = (u == 0) ? 5973 : 8192;
-            int alpha_v = (v == 0) ? 5973 : 8192;
-            int64_t temp = dct_data[v * 8 + u];
-            temp = (int)(((int64_t)temp * alpha_u * alpha_v + (1LL << (2 * 14 - 1))) >> (2 * 14));
-            quant_data[v * 8 + u] = (short)(temp / quant_table[v * 8 + u]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+
+    int encoded = 0;
+    double megaPixels = 0;
+    for (int i = 0; i < batch.itemCount; i++) {
+        if (batch.items[i].pixels > 0) {
+            encoded++;
+            megaPixels += (double)batch.items[i].pixels / 1e6;
         }
+        free(batch.items[i].inputFile);
+        free(batch.items[i].outputFile);
     }
-}
 
-// ジグザグ処理
-void JpegEncoder_ZigZag(const short* quant_data, short* fdc_data) {
-    for (int v = 0; v < 8; v++) {
-        for (int u = 0; u < 8; u++) {
-            int zigZagIndex = ZigZag[v * 8 + u];
-            fdc_data[zigZagIndex] = quant_data[v * 8 + u];
+    if (listed) {
+        printf("Encoded %d of %d files (%.1f MPixels) in %.3f s with %d workers: %.1f files/s, %.1f MPixels/s\n",
+               encoded, batch.itemCount, megaPixels, seconds, workerCount,
+               seconds > 0 ? encoded / seconds : 0.0, seconds > 0 ? megaPixels / seconds : 0.0);
+    }
+    if (listed && options->cacheEntries > 0) {
+        // キャッシュはワーカーごとなので、全ワーカーの合計を表示する
+        JpegEncoder_MCUCacheStats total;
+        memset(&total, 0, sizeof(total));
+        for (int i = 0; i < workerCount; i++) {
+            total.hits += workers[i].cacheStats.hits;
+            total.misses += workers[i].cacheStats.misses;
+            total.evictions += workers[i].cacheStats.evictions;
+            total.entries += workers[i].cacheStats.entries;
         }
+        printCacheStats(&total);
     }
+
+    int success = listed && encoded == batch.itemCount;
+    free(batch.items);
+    free(batch.queues);
+    free(workers);
+    return success;
 }
 
-// DCTと量子化（整数演算版）
-void JpegEncoder_foword_FDC(const char* channel_data, short* fdc_data, const unsigned char* quant_table) {
-    int64_t dct_data[64];
-    short quant_data[64];
+// -iの引数（format:WxH）の解釈
+int parseRawFormat(const char* arg, EncodeOptions* options) {
+    static const char* const formatNames[] = { "bgr", "bgrx", "rgba", "i420", "nv12", "yuyv" };  // JpegEncoder_PixelFormatの順
+    const char* colon = strchr(arg, ':');
+    if (!colon) return 0;
 
-    JpegEncoder_DCT(channel_data, dct_data);
-    JpegEncoder_Quantize(dct_data, quant_data, quant_table);
-    JpegEncoder_ZigZag(quant_data, fdc_data);
-}
+    int format = -1;
+    for (int i = 0; i < (int)(sizeof(formatNames) / sizeof(formatNames[0])); i++) {
+        if (strlen(formatNames[i]) == (size_t)(colon - arg) && strncmp(arg, formatNames[i], colon - arg) == 0) format = i;
+    }
+    int width, height;
+    char extra;
+    if (format < 0 || sscanf(colon + 1, "%dx%d%c", &width, &height, &extra) != 2) return 0;
 
-// JPEGヘッダ書き込み
-void JpegEncoder_write_jpeg_header(JpegEncoder* encoder, FILE* fp) {
-    // SOI
-    JpegEncoder_write_word(0xFFD8, fp);
-
-    // APP0
-    JpegEncoder_write_word(0xFFE0, fp);
-    JpegEncoder_write_word(16, fp);
-    JpegEncoder_write("JFIF\0", 5, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write_word(1, fp);
-    JpegEncoder_write_word(1, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write_byte(0, fp);
-
-    // DQT
-    JpegEncoder_write_word(0xFFDB, fp);
-    JpegEncoder_write_word(132, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write(encoder->YTable, 64, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write(encoder->CbCrTable, 64, fp);
-
-    // SOF0
-    JpegEncoder_write_word(0xFFC0, fp);
-    JpegEncoder_write_word(17, fp);
-    JpegEncoder_write_byte(8, fp);
-    JpegEncoder_write_word(encoder->height & 0xFFFF, fp);
-    JpegEncoder_write_word(encoder->width & 0xFFFF, fp);
-    JpegEncoder_write_byte(3, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write_byte(0x22, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write_byte(2, fp);
-    JpegEncoder_write_byte(0x11, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write_byte(3, fp);
-    JpegEncoder_write_byte(0x11, fp);
-    JpegEncoder_write_byte(1, fp);
-
-    // DHT
-    JpegEncoder_write_word(0xFFC4, fp);
-    JpegEncoder_write_word(0x01A2, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write(Standard_DC_Luminance_NRCodes, sizeof(Standard_DC_Luminance_NRCodes), fp);
-    JpegEncoder_write(Standard_DC_Luminance_Values, sizeof(Standard_DC_Luminance_Values), fp);
-    JpegEncoder_write_byte(0x10, fp);
-    JpegEncoder_write(Standard_AC_Luminance_NRCodes, sizeof(Standard_AC_Luminance_NRCodes), fp);
-    JpegEncoder_write(Standard_AC_Luminance_Values, sizeof(Standard_AC_Luminance_Values), fp);
-    JpegEncoder_write_byte(0x01, fp);
-    JpegEncoder_write(Standard_DC_Chrominance_NRCodes, sizeof(Standard_DC_Chrominance_NRCodes), fp);
-    JpegEncoder_write(Standard_DC_Chrominance_Values, sizeof(Standard_DC_Chrominance_Values), fp);
-    JpegEncoder_write_byte(0x11, fp);
-    JpegEncoder_write(Standard_AC_Chrominance_NRCodes, sizeof(Standard_AC_Chrominance_NRCodes), fp);
-    JpegEncoder_write(Standard_AC_Chrominance_Values, sizeof(Standard_AC_Chrominance_Values), fp);
-
-    // SOS
-    JpegEncoder_write_word(0xFFDA, fp);
-    JpegEncoder_write_word(12, fp);
-    JpegEncoder_write_byte(3, fp);
-    JpegEncoder_write_byte(1, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write_byte(2, fp);
-    JpegEncoder_write_byte(0x11, fp);
-    JpegEncoder_write_byte(3, fp);
-    JpegEncoder_write_byte(0x11, fp);
-    JpegEncoder_write_byte(0, fp);
-    JpegEncoder_write_byte(0x3F, fp);
-    JpegEncoder_write_byte(0, fp);
+    options->rawFormat = format;
+    options->rawWidth = width;
+    options->rawHeight = height;
+    return 1;
 }
 
 // メインプログラム
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <input.bmp> <output.jpg> <quality_scale>\n", argv[0]);
+    EncodeOptions options;
+    options.dctMethod = JPEG_DCT_FAST;
+    options.restartInterval = 0;
+    options.threadCount = 1;
+    options.parallelMode = JPEG_PARALLEL_SEGMENTS;
+    options.subsampling = JPEG_SUBSAMPLING_420;
+    options.flatThreshold = 0;  // 完全に一様なブロックのみDCTを省く
+    options.optimize = 0;
+    options.streaming = 0;
+    options.maxBytes = 0;
+    options.rawFormat = -1;
+    options.rawWidth = 0;
+    options.rawHeight = 0;
+    options.cacheEntries = 0;
+    const char* kernelName = NULL;
+    int batchMode = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:k:r:t:p:c:i:m:f:sob:B")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (strcmp(optarg, "fast") == 0) options.dctMethod = JPEG_DCT_FAST;
+            else if (strcmp(optarg, "ref") == 0) options.dctMethod = JPEG_DCT_REFERENCE;
+            else {
+                fprintf(stderr, "Error: Unknown DCT method %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            kernelName = optarg;
+            break;
+        case 'r':
+            options.restartInterval = atoi(optarg);
+            break;
+        case 't':
+            options.threadCount = atoi(optarg);
+            break;
+        case 'p':
+            if (strcmp(optarg, "segments") == 0) options.parallelMode = JPEG_PARALLEL_SEGMENTS;
+            else if (strcmp(optarg, "pipeline") == 0) options.parallelMode = JPEG_PARALLEL_PIPELINE;
+            else {
+                fprintf(stderr, "Error: Unknown parallel mode %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            if (strcmp(optarg, "420") == 0) options.subsampling = JPEG_SUBSAMPLING_420;
+            else if (strcmp(optarg, "422") == 0) options.subsampling = JPEG_SUBSAMPLING_422;
+            else if (strcmp(optarg, "444") == 0) options.subsampling = JPEG_SUBSAMPLING_444;
+            else if (strcmp(optarg, "gray") == 0) options.subsampling = JPEG_SUBSAMPLING_GRAY;
+            else {
+                fprintf(stderr, "Error: Unknown subsampling %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            if (!parseRawFormat(optarg, &options)) {
+                fprintf(stderr, "Error: Raw input must be format:WxH (bgr|bgrx|rgba|i420|nv12|yuyv), not %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            options.cacheEntries = atoi(optarg);
+            break;
+        case 'f':
+            options.flatThreshold = atoi(optarg);
+            break;
+        case 's':
+            options.streaming = 1;
+            break;
+        case 'o':
+            options.optimize = 1;
+            break;
+        case 'b':
+            options.maxBytes = atol(optarg);
+            if (options.maxBytes <= 0) {
+                fprintf(stderr, "Error: Target size must be at least 1 byte\n");
+                return 1;
+            }
+            break;
+        case 'B':
+            batchMode = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, USAGE, argv[0], argv[0]);
         return 1;
     }
-
-    JpegEncoder encoder = {
-        .Y_DC_Huffman_Table = {
-            {3, 0x0006}, {3, 0x0005}, {3, 0x0003}, {3, 0x0002}, {3, 0x0000}, {3, 0x0001}, {3, 0x0004}, {4, 0x000e}, {5, 0x001e}, {6, 0x003e}, {7, 0x007e}, {8, 0x00fe} },
-        .Y_AC_Huffman_Table = {
-            {4, 0x000a}, {2, 0x0000}, {2, 0x0001}, {3, 0x0004}, {4, 0x000b}, {5, 0x001a}, {7, 0x0078}, {8, 0x00f8}, {10, 0x03f6}, {16, 0xff82}, {16, 0xff83}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {4, 0x000c}, {5, 0x001b}, {7, 0x0079}, {9, 0x01f6}, {11, 0x07f6}, {16, 0xff84}, {16, 0xff85}, {16, 0xff86}, {16, 0xff87}, {16, 0xff88}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {5, 0x001c}, {8, 0x00f9}, {10, 0x03f7}, {12, 0x0ff4}, {16, 0xff89}, {16, 0xff8a}, {16, 0xff8b}, {16, 0xff8c}, {16, 0xff8d}, {16, 0xff8e}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {6, 0x003a}, {9, 0x01f7}, {12, 0x0ff5}, {16, 0xff8f}, {16, 0xff90}, {16, 0xff91}, {16, 0xff92}, {16, 0xff93}, {16, 0xff94}, {16, 0xff95}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {6, 0x003b}, {10, 0x03f8}, {16, 0xff96}, {16, 0xff97}, {16, 0xff98}, {16, 0xff99}, {16, 0xff9a}, {16, 0xff9b}, {16, 0xff9c}, {16, 0xff9d}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {7, 0x007a}, {11, 0x07f7}, {16, 0xff9e}, {16, 0xff9f}, {16, 0xffa0}, {16, 0xffa1}, {16, 0xffa2}, {16, 0xffa3}, {16, 0xffa4}, {16, 0xffa5}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {7, 0x007b}, {12, 0x0ff6}, {16, 0xffa6}, {16, 0xffa7}, {16, 0xffa8}, {16, 0xffa9}, {16, 0xffaa}, {16, 0xffab}, {16, 0xffac}, {16, 0xffad}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {8, 0x00fa}, {12, 0x0ff7}, {16, 0xffae}, {16, 0xffaf}, {16, 0xffb0}, {16, 0xffb1}, {16, 0xffb2}, {16, 0xffb3}, {16, 0xffb4}, {16, 0xffb5}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01f8}, {15, 0x7fc0}, {16, 0xffb6}, {16, 0xffb7}, {16, 0xffb8}, {16, 0xffb9}, {16, 0xffba}, {16, 0xffbb}, {16, 0xffbc}, {16, 0xffbd}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01f9}, {16, 0xffbe}, {16, 0xffbf}, {16, 0xffc0}, {16, 0xffc1}, {16, 0xffc2}, {16, 0xffc3}, {16, 0xffc4}, {16, 0xffc5}, {16, 0xffc6}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01fa}, {16, 0xffc7}, {16, 0xffc8}, {16, 0xffc9}, {16, 0xffca}, {16, 0xffcb}, {16, 0xffcc}, {16, 0xffcd}, {16, 0xffce}, {16, 0xffcf}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {10, 0x03f9}, {16, 0xffd0}, {16, 0xffd1}, {16, 0xffd2}, {16, 0xffd3}, {16, 0xffd4}, {16, 0xffd5}, {16, 0xffd6}, {16, 0xffd7}, {16, 0xffd8}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {10, 0x03fa}, {16, 0xffd9}, {16, 0xffda}, {16, 0xffdb}, {16, 0xffdc}, {16, 0xffdd}, {16, 0xffde}, {16, 0xffdf}, {16, 0xffe0}, {16, 0xffe1}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {11, 0x07f8}, {16, 0xffe2}, {16, 0xffe3}, {16, 0xffe4}, {16, 0xffe5}, {16, 0xffe6}, {16, 0xffe7}, {16, 0xffe8}, {16, 0xffe9}, {16, 0xffea}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {16, 0xffeb}, {16, 0xffec}, {16, 0xffed}, {16, 0xffee}, {16, 0xffef}, {16, 0xfff0}, {16, 0xfff1}, {16, 0xfff2}, {16, 0xfff3}, {16, 0xfff4}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {11, 0x07f9}, {16, 0xfff5}, {16, 0xfff6}, {16, 0xfff7}, {16, 0xfff8}, {16, 0xfff9}, {16, 0xfffa}, {16, 0xfffb}, {16, 0xfffc}, {16, 0xfffd}, {16, 0xfffe}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000} },
-        .CbCr_DC_Huffman_Table = {
-            {2, 0x0000}, {2, 0x0001}, {2, 0x0002}, {3, 0x0006}, {4, 0x000e}, {5, 0x001e}, {6, 0x003e}, {7, 0x007e}, {8, 0x00fe}, {9, 0x01fe}, {10, 0x03fe}, {11, 0x07fe} },
-        .CbCr_AC_Huffman_Table = {
-            {2, 0x0000}, {2, 0x0001}, {3, 0x0004}, {4, 0x000a}, {5, 0x0018}, {5, 0x0019}, {6, 0x0038}, {7, 0x0078}, {9, 0x01f4}, {10, 0x03f6}, {12, 0x0ff4}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {4, 0x000b}, {6, 0x0039}, {8, 0x00f6}, {9, 0x01f5}, {11, 0x07f6}, {12, 0x0ff5}, {16, 0xff88}, {16, 0xff89}, {16, 0xff8a}, {16, 0xff8b}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {5, 0x001a}, {8, 0x00f7}, {10, 0x03f7}, {12, 0x0ff6}, {15, 0x7fc2}, {16, 0xff8c}, {16, 0xff8d}, {16, 0xff8e}, {16, 0xff8f}, {16, 0xff90}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {5, 0x001b}, {8, 0x00f8}, {10, 0x03f8}, {12, 0x0ff7}, {16, 0xff91}, {16, 0xff92}, {16, 0xff93}, {16, 0xff94}, {16, 0xff95}, {16, 0xff96}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {6, 0x003a}, {9, 0x01f6}, {16, 0xff97}, {16, 0xff98}, {16, 0xff99}, {16, 0xff9a}, {16, 0xff9b}, {16, 0xff9c}, {16, 0xff9d}, {16, 0xff9e}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {6, 0x003b}, {10, 0x03f9}, {16, 0xff9f}, {16, 0xffa0}, {16, 0xffa1}, {16, 0xffa2}, {16, 0xffa3}, {16, 0xffa4}, {16, 0xffa5}, {16, 0xffa6}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {7, 0x0079}, {11, 0x07f7}, {16, 0xffa7}, {16, 0xffa8}, {16, 0xffa9}, {16, 0xffaa}, {16, 0xffab}, {16, 0xffac}, {16, 0xffad}, {16, 0xffae}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {7, 0x007a}, {11, 0x07f8}, {16, 0xffaf}, {16, 0xffb0}, {16, 0xffb1}, {16, 0xffb2}, {16, 0xffb3}, {16, 0xffb4}, {16, 0xffb5}, {16, 0xffb6}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {8, 0x00f9}, {16, 0xffb7}, {16, 0xffb8}, {16, 0xffb9}, {16, 0xffba}, {16, 0xffbb}, {16, 0xffbc}, {16, 0xffbd}, {16, 0xffbe}, {16, 0xffbf}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01f7}, {16, 0xffc0}, {16, 0xffc1}, {16, 0xffc2}, {16, 0xffc3}, {16, 0xffc4}, {16, 0xffc5}, {16, 0xffc6}, {16, 0xffc7}, {16, 0xffc8}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01f8}, {16, 0xffc9}, {16, 0xffca}, {16, 0xffcb}, {16, 0xffcc}, {16, 0xffcd}, {16, 0xffce}, {16, 0xffcf}, {16, 0xffd0}, {16, 0xffd1}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01f9}, {16, 0xffd2}, {16, 0xffd3}, {16, 0xffd4}, {16, 0xffd5}, {16, 0xffd6}, {16, 0xffd7}, {16, 0xffd8}, {16, 0xffd9}, {16, 0xffda}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {9, 0x01fa}, {16, 0xffdb}, {16, 0xffdc}, {16, 0xffdd}, {16, 0xffde}, {16, 0xffdf}, {16, 0xffe0}, {16, 0xffe1}, {16, 0xffe2}, {16, 0xffe3}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {11, 0x07f9}, {16, 0xffe4}, {16, 0xffe5}, {16, 0xffe6}, {16, 0xffe7}, {16, 0xffe8}, {16, 0xffe9}, {16, 0xffea}, {16, 0xffeb}, {16, 0xffec}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {14, 0x3fe0}, {16, 0xffed}, {16, 0xffee}, {16, 0xffef}, {16, 0xfff0}, {16, 0xfff1}, {16, 0xfff2}, {16, 0xfff3}, {16, 0xfff4}, {16, 0xfff5}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {10, 0x03fa}, {15, 0x7fc3}, {16, 0xfff6}, {16, 0xfff7}, {16, 0xfff8}, {16, 0xfff9}, {16, 0xfffa}, {16, 0xfffb}, {16, 0xfffc}, {16, 0xfffd}, {16, 0xfffe}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000}, {0, 0x0000} },
-        .YTable = {
-            12, 8, 9, 11, 9, 8, 12, 11, 10, 11, 14, 13, 12, 14, 18, 30, 20, 18, 17, 17, 18, 37, 26, 28, 22, 30, 44, 38, 46, 45, 43, 38, 42, 41, 48, 54, 69, 59, 48, 51, 65, 52, 41, 42, 60, 82, 61, 65, 71, 74, 77, 78, 77, 47, 58, 85, 91, 84, 75, 90, 69, 76, 77, 74 },
-        .CbCrTable = {
-            13, 14, 14, 18, 16, 18, 35, 20, 20, 35, 74, 50, 42, 50, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74, 74 }
-    };
-
-    if (!JpegEncoder_readFromBMP(&encoder, argv[1])) {
-        fprintf(stderr, "Error: Failed to read BMP file %s\n", argv[1]);
+    if (options.streaming && options.rawFormat >= 0) {
+        fprintf(stderr, "Error: Streaming needs a BMP input\n");
         return 1;
     }
-
-    int quality_scale = atoi(argv[3]);
-    if (quality_scale < 1 || quality_scale > 100) {
-        fprintf(stderr, "Error: Quality scale must be between 1 and 100\n");
+    if (!JpegEncoder_initKernels(kernelName)) {
+        fprintf(stderr, "Error: Kernel %s is not supported on this CPU\n", kernelName);
         return 1;
     }
 
-    if (!JpegEncoder_encodeToJPG(&encoder, argv[2], quality_scale)) {
-        fprintf(stderr, "Error: Failed to encode to JPEG file %s\n", argv[2]);
+    const char* inputFile = argv[optind];
+    const char* outputFile = argv[optind + 1];
+    options.quality = atoi(argv[optind + 2]);
+
+    if (options.quality < 1 || options.quality > 100) {
+        fprintf(stderr, "Error: Quality must be between 1 and 100\n");
         return 1;
     }
 
-    printf("Successfully encoded %s to %s\n", argv[1], argv[2]);
+    // バッチエンコードではスレッドをファイル単位の並列化に使い、各エンコーダは1スレッドで動かす
+    if (batchMode) {
+        int workerCount = options.threadCount;
+        if (workerCount < 1) {
+            fprintf(stderr, "Error: Thread count must be at least 1\n");
+            return 1;
+        }
+        options.threadCount = 1;
+        return encodeBatch(&options, inputFile, outputFile, workerCount) ? 0 : 1;
+    }
+
+    JpegEncoder* encoder = createEncoder(&options);
+    if (!encoder) return 1;
+
+    long pixels;
+    int success = encodeFile(encoder, &options, inputFile, outputFile, &pixels);
+    if (success && options.cacheEntries > 0) {
+        JpegEncoder_MCUCacheStats stats;
+        JpegEncoder_getMCUCacheStats(encoder, &stats);
+        printCacheStats(&stats);
+    }
+    JpegEncoder_destroy(encoder);
+    if (!success) return 1;
+
+    printf("Successfully encoded %s to %s\n", inputFile, outputFile);
     return 0;
 }
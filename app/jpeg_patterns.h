@@ -0,0 +1,100 @@
+/*
+JPEG Encoder 合成画像
+ベンチマークとテストで使う合成画像（ノイズ、グラデーション、平坦、文字風、写真風）の生成
+*/
+#ifndef JPEG_PATTERNS_H
+#define JPEG_PATTERNS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// 合成画像の種類
+enum { PATTERN_NOISE, PATTERN_GRADIENT, PATTERN_FLAT, PATTERN_TEXT, PATTERN_PHOTO, PATTERN_COUNT };
+static const char* PatternNames[PATTERN_COUNT] = { "noise", "gradient", "flat", "text", "photo" };
+
+// 再現性のある疑似乱数（xorshift32）
+static uint32_t nextRandom(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static unsigned char clampPixel(double value) {
+    return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)value;
+}
+
+// 1画素の生成（RGB）
+static void generatePixel(int pattern, int x, int y, int width, int height, uint32_t* random, unsigned char* rgb) {
+    switch (pattern) {
+    case PATTERN_NOISE: {
+        uint32_t r = nextRandom(random);
+        rgb[0] = (unsigned char)r;
+        rgb[1] = (unsigned char)(r >> 8);
+        rgb[2] = (unsigned char)(r >> 16);
+        break;
+    }
+    case PATTERN_GRADIENT:
+        rgb[0] = (unsigned char)(x * 255 / (width - 1));
+        rgb[1] = (unsigned char)(y * 255 / (height - 1));
+        rgb[2] = (unsigned char)((x + y) * 255 / (width + height - 2));
+        break;
+    case PATTERN_FLAT: {
+        // 白い背景に単色の矩形（ウィンドウやボタンのような領域）
+        int cell = ((x / (width / 8)) * 7 + (y / (height / 6)) * 3) % 5;
+        static const unsigned char colors[5][3] = {
+            { 255, 255, 255 }, { 240, 240, 240 }, { 32, 96, 200 }, { 255, 255, 255 }, { 200, 200, 200 }
+        };
+        memcpy(rgb, colors[cell], 3);
+        break;
+    }
+    case PATTERN_TEXT: {
+        // 白い背景に黒い文字風のストローク（12画素の行に6x8画素の文字）
+        int line = y / 12, row = y % 12;
+        int column = x / 6, dx = x % 6;
+        uint32_t glyph = (uint32_t)(line * 7919 + column * 104729) * 2654435761u;
+        int ink = row >= 2 && row < 10 && dx < 5 && (glyph >> 28) != 0 &&
+                  ((glyph >> ((row - 2) * 4 + (dx % 4))) & 1);
+        rgb[0] = rgb[1] = rgb[2] = ink ? 0 : 255;
+        break;
+    }
+    default: {
+        // 写真風：滑らかな背景、円形の物体、わずかなノイズ
+        double u = (double)x / width, v = (double)y / height;
+        double r = 120 + 80 * sin(u * 5.0 + v * 2.0) + 30 * cos(v * 11.0);
+        double g = 110 + 70 * sin(v * 4.0 - u * 3.0) + 20 * sin(u * 17.0);
+        double b = 100 + 60 * cos(u * 3.0 + v * 6.0);
+        double dx = u - 0.6, dy = v - 0.45;
+        if (dx * dx + dy * dy < 0.04) {
+            r = 220 - 150 * (dx * dx + dy * dy) / 0.04;
+            g *= 0.5;
+            b *= 0.4;
+        }
+        int noise = (int)(nextRandom(random) % 9) - 4;
+        rgb[0] = clampPixel(r + noise);
+        rgb[1] = clampPixel(g + noise);
+        rgb[2] = clampPixel(b + noise);
+        break;
+    }
+    }
+}
+
+// 合成画像をBGRのバッファ（上の行から、行間はwidth*3バイト）に生成
+// 乱数は下の行から順に使う（writeImageがBMPに書き出す行の順と同じ）
+static inline void generatePattern(int pattern, int width, int height, unsigned char* bgr) {
+    uint32_t random = 2463534242u;
+    for (int y = height - 1; y >= 0; y--) {
+        unsigned char* row = bgr + (size_t)y * width * 3;
+        for (int x = 0; x < width; x++) {
+            unsigned char rgb[3];
+            generatePixel(pattern, x, y, width, height, &random, rgb);
+            row[x * 3] = rgb[2];
+            row[x * 3 + 1] = rgb[1];
+            row[x * 3 + 2] = rgb[0];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,555 @@
+/*
+JPEG Encoder テスト
+合成画像（jpeg_patterns.h）をメモリ上に生成し、エンコーダの内部処理と出力を確認する
+1項目でも失敗すれば終了コード1を返す
+*/
+#include "jpegenc.c"  // 内部のDCTや量子化を直接呼ぶため、ライブラリのソースごと取り込む
+#include "jpeg_patterns.h"
+
+// テスト画像の大きさ（MCU行数・列数が2の累乗にならない大きさも含める）
+static const int TestSizes[][2] = { { 640, 480 }, { 272, 208 } };
+#define TEST_SIZE_COUNT ((int)(sizeof(TestSizes) / sizeof(TestSizes[0])))
+
+// DCTの比較に使う品質
+static const int TestQualities[] = { 10, 25, 50, 75, 90, 100 };
+#define TEST_QUALITY_COUNT ((int)(sizeof(TestQualities) / sizeof(TestQualities[0])))
+
+// チェックサムを比較するエンコードの品質
+#define TEST_ENCODE_QUALITY 75
+
+// チェックサムを比較するエンコードの設定
+// 比較の基準は同じサブサンプリングとリスタートインターバルで、scalarカーネル、1スレッド、
+// 平坦ブロックの省略なし、MCUキャッシュなし、画像全体を一度に渡すエンコード
+typedef struct {
+    const char* name;
+    const char* kernel;
+    int threadCount;
+    int parallelMode;
+    int restartInterval;
+    int flatThreshold;
+    int cacheEntries;
+    int streaming;     // 1: 16行ずつのストリップで渡す
+    int warmEncodes;   // 比べるエンコードの前に、同じエンコーダで同じ画像をエンコードする回数（MCUキャッシュを温める）
+} TestConfig;
+
+// カーネルの比較（出力はscalarとビット単位で一致すること）
+static const TestConfig KernelConfigs[] = {
+    { "sse4.1", "sse4.1", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "avx2", "avx2", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+};
+// 平坦ブロックの省略（閾値0は完全に一様なブロックだけを省くので、出力はDCTを行った場合と一致すること）
+static const TestConfig FlatConfigs[] = {
+    { "flat 0 scalar", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, 0, 0, 0, 0 },
+    { "flat 0 sse4.1", "sse4.1", 1, JPEG_PARALLEL_SEGMENTS, 0, 0, 0, 0, 0 },
+    { "flat 0 avx2", "avx2", 1, JPEG_PARALLEL_SEGMENTS, 0, 0, 0, 0, 0 },
+};
+// 並列エンコードとストリーミング（出力は1スレッドで画像全体を渡した場合と一致すること）
+static const TestConfig ParallelConfigs[] = {
+    { "segments 2", "scalar", 2, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "segments 4", "scalar", 4, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "segments 7 avx2", "avx2", 7, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "pipeline 2", "scalar", 2, JPEG_PARALLEL_PIPELINE, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "pipeline 4", "scalar", 4, JPEG_PARALLEL_PIPELINE, 0, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "restart 8 x3", "scalar", 3, JPEG_PARALLEL_SEGMENTS, 8, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "restart row x4", "scalar", 4, JPEG_PARALLEL_SEGMENTS, JPEG_RESTART_MCU_ROW, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 },
+    { "streaming", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 0, 1, 0 },
+    { "streaming restart 8", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 8, JPEG_FLAT_BLOCKS_OFF, 0, 1, 0 },
+};
+// MCUキャッシュ（ヒットしても追い出されても、出力はキャッシュなしの場合と一致すること）
+static const TestConfig CacheConfigs[] = {
+    { "cache 1", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 1, 0, 0 },
+    { "cache 64", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 64, 0, 0 },
+    { "cache 100000", "avx2", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 100000, 0, 0 },
+    { "cache 64 warm", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 64, 0, 1 },
+    { "cache 100000 warm", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 100000, 0, 1 },
+    { "cache segments 4", "scalar", 4, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 64, 0, 0 },
+    { "cache pipeline 2 warm", "scalar", 2, JPEG_PARALLEL_PIPELINE, 0, JPEG_FLAT_BLOCKS_OFF, 64, 0, 1 },
+    { "cache restart 8 x3", "scalar", 3, JPEG_PARALLEL_SEGMENTS, 8, JPEG_FLAT_BLOCKS_OFF, 64, 0, 0 },
+    { "cache streaming warm", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, JPEG_FLAT_BLOCKS_OFF, 100000, 1, 1 },
+    { "cache flat 0", "scalar", 1, JPEG_PARALLEL_SEGMENTS, 0, 0, 64, 0, 0 },
+};
+#define TEST_CONFIG_COUNT(configs) ((int)(sizeof(configs) / sizeof(configs[0])))
+
+static const char* const SubsamplingNames[] = { "420", "422", "444", "gray" };  // JPEG_SUBSAMPLING_xxxの順
+
+static int testFailures = 0;
+
+// 1項目の結果の表示
+void report(int ok, const char* test, const char* image, const char* detail) {
+    printf("%s %-28s %-16s %s\n", ok ? "ok  " : "FAIL", test, image, detail);
+    if (!ok) testFailures++;
+}
+
+// 高速DCT+量子化と定義式どおりのDCT+量子化の比較
+// 4:2:0で色空間変換した全ブロック、全品質で量子化後の係数の差が±1以内であること
+void testFastDCT(const unsigned char* bgr, int width, int height, const char* image) {
+    int maxDiff = 0;
+    long coefficients = 0, offByOne = 0;
+
+    for (int yPos = 0; yPos < height; yPos += 16) {
+        for (int xPos = 0; xPos < width; xPos += 16) {
+            char blocks[6][64];
+            JpegEncoder_convertColorSpace(bgr, blocks[0], blocks[4], blocks[5], width * 3, xPos, yPos);
+
+            for (int b = 0; b < 6; b++) {
+                int64_t refDCT[64];
+                int32_t fastDCT[64];
+                JpegEncoder_DCT(blocks[b], refDCT);
+                JpegEncoder_DCT_fast(blocks[b], fastDCT);
+
+                for (int q = 0; q < TEST_QUALITY_COUNT; q++) {
+                    const JpegEncoder_QuantTables* tables = JpegEncoder_getQuantTables(TestQualities[q]);
+                    short refQuant[64], fastQuant[64];
+                    JpegEncoder_Quantize(refDCT, refQuant, b < 4 ? tables->YTable : tables->CbCrTable);
+                    JpegEncoder_Quantize_fast(fastDCT, fastQuant, b < 4 ? tables->YRecip : tables->CbCrRecip);
+
+                    for (int i = 0; i < 64; i++) {
+                        int diff = abs(refQuant[i] - fastQuant[i]);
+                        if (diff > maxDiff) maxDiff = diff;
+                        if (diff == 1) offByOne++;
+                    }
+                    coefficients += 64;
+                }
+            }
+        }
+    }
+
+    char detail[128];
+    snprintf(detail, sizeof(detail), "max |diff| %d, %ld of %ld coefficients off by 1", maxDiff, offByOne, coefficients);
+    report(maxDiff <= 1, "fast DCT vs reference", image, detail);
+}
+
+// 色空間変換の基準（融合前と同じ2パスの実装）
+// 先にYブロックを1つずつ求め、次にH×Vピクセルごとに1ピクセルずつ>>8したCb/Crを合計して0方向に切り捨てて割る
+void referenceConvert(const unsigned char* rgbBuffer, int stride, int xPos, int yPos, int H, int V, int chroma, char (*blocks)[64]) {
+    for (int blockY = 0; blockY < V; blockY++) {
+        for (int blockX = 0; blockX < H; blockX++) {
+            char* yBlock = blocks[blockY * H + blockX];
+            for (int y = 0; y < 8; y++) {
+                const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + blockY * 8 + y) * stride + (xPos + blockX * 8) * 3;
+                for (int x = 0; x < 8; x++) {
+                    int B = *p++;
+                    int G = *p++;
+                    int R = *p++;
+                    yBlock[y * 8 + x] = (char)(((76 * R + 150 * G + 29 * B) >> 8) - 128);
+                }
+            }
+        }
+    }
+    if (!chroma) return;
+
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            int cbSum = 0, crSum = 0;
+            for (int dy = 0; dy < V; dy++) {
+                for (int dx = 0; dx < H; dx++) {
+                    const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + y * V + dy) * stride + (xPos + x * H + dx) * 3;
+                    int B = p[0];
+                    int G = p[1];
+                    int R = p[2];
+                    cbSum += (-43 * R - 85 * G + 128 * B) >> 8;
+                    crSum += (128 * R - 107 * G - 21 * B) >> 8;
+                }
+            }
+            blocks[H * V][y * 8 + x] = (char)(cbSum / (H * V));
+            blocks[H * V + 1][y * 8 + x] = (char)(crSum / (H * V));
+        }
+    }
+}
+
+// 各カーネルの融合した色空間変換と2パスの基準の比較（全サブサンプリング、全MCU）
+// 上から下の行順と、BMPと同じ下から上の行順（負のストライド）の両方で、ブロックがビット単位で一致すること
+void testConvert(const unsigned char* bgr, int width, int height, const char* image) {
+    static const char* const kernels[] = { "scalar", "sse4.1", "avx2" };
+    static const int factors[][3] = { { 2, 2, 1 }, { 2, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 } };  // H, V, 色差の有無
+    long compared = 0;
+    int skipped = 0, ok = 1;
+    char detail[256] = "";
+
+    for (int k = 0; k < (int)(sizeof(kernels) / sizeof(kernels[0])); k++) {
+        if (!JpegEncoder_initKernels(kernels[k])) {
+            skipped++;
+            continue;
+        }
+        void (*const converters[])(const unsigned char*, char*, char*, char*, int, int, int) = {
+            JpegEncoder_kernels.convert, JpegEncoder_kernels.convert422, JpegEncoder_kernels.convert444, JpegEncoder_kernels.convertGray
+        };
+
+        for (int subsampling = JPEG_SUBSAMPLING_420; subsampling <= JPEG_SUBSAMPLING_GRAY; subsampling++) {
+            int H = factors[subsampling][0], V = factors[subsampling][1], chroma = factors[subsampling][2];
+            int blockCount = H * V + (chroma ? 2 : 0);
+
+            for (int flip = 0; flip < 2; flip++) {
+                const unsigned char* rgbBuffer = flip ? bgr + (size_t)(height - 1) * width * 3 : bgr;
+                int stride = flip ? -width * 3 : width * 3;
+
+                for (int yPos = 0; yPos < height; yPos += V * 8) {
+                    for (int xPos = 0; xPos < width; xPos += H * 8) {
+                        char expected[6][64], actual[6][64];
+                        referenceConvert(rgbBuffer, stride, xPos, yPos, H, V, chroma, expected);
+                        converters[subsampling](rgbBuffer, actual[0], actual[H * V], actual[H * V + 1], stride, xPos, yPos);
+                        if (memcmp(expected, actual, (size_t)blockCount * 64) != 0) {
+                            if (ok) snprintf(detail, sizeof(detail), "%s differs at %s MCU (%d, %d)%s", kernels[k], SubsamplingNames[subsampling], xPos, yPos, flip ? " bottom-up" : "");
+                            ok = 0;
+                        }
+                        compared++;
+                    }
+                }
+            }
+        }
+    }
+    JpegEncoder_initKernels("scalar");
+
+    if (ok) snprintf(detail, sizeof(detail), "%ld MCUs identical, %d kernel(s) skipped (unsupported)", compared, skipped);
+    report(ok, "fused convert vs two-pass", image, detail);
+}
+
+// 目標サイズでのエンコードの失敗後に、呼び出し前の品質が残っていることの確認
+// 収まらない目標では失敗して品質が変わらず、収まる目標では選んだ品質が設定されること
+void testEncodeToSize(const unsigned char* bgr, int width, int height, const char* image) {
+    static const int callerQuality = 42;
+    JpegEncoder* encoder = JpegEncoder_create();
+    JpegEncoder_Coefficients* coefficients = encoder ? JpegEncoder_analyze(encoder, bgr, width, height, width * 3) : NULL;
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
+    char detail[128] = "cannot analyze the image";
+    int ok = 0;
+
+    if (coefficients && JpegEncoder_setQuality(encoder, callerQuality)) {
+        int quality = 0;
+        int tooSmall = JpegEncoder_encodeToSize(encoder, coefficients, 16, &sink, &quality);
+        int restored = encoder->quality;
+        int fits = JpegEncoder_encodeToSize(encoder, coefficients, SIZE_MAX, &sink, &quality);
+        ok = !tooSmall && restored == callerQuality && fits && quality == 100 && encoder->quality == 100;
+        snprintf(detail, sizeof(detail), "quality %d after a failed search, %d after a successful one", restored, encoder->quality);
+    }
+    report(ok, "encodeToSize keeps quality", image, detail);
+
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_freeCoefficients(coefficients);
+    JpegEncoder_destroy(encoder);
+}
+
+// 最適化ハフマンテーブルの符号長の確認
+// フィボナッチ数列の頻度は最適な符号長が16bitを大きく超えるので、長さの制限が働く
+// 符号長の数の合計がシンボル数と一致し、すべて16bit以下で、予約したすべて1の符号を除くのでクラフト和が1未満であること
+void testOptimalSpec(void) {
+    static const int symbolCounts[] = { 12, 40, 162, 256 };
+    int ok = 1;
+    char detail[128] = "";
+
+    for (int c = 0; c < (int)(sizeof(symbolCounts) / sizeof(symbolCounts[0])); c++) {
+        int symbolCount = symbolCounts[c];
+        long freq[256];
+        long a = 1, b = 1;
+        int used = 0;
+        for (int i = 0; i < symbolCount; i++) {
+            // 40個を超えるとlongの範囲を超えるので、フィボナッチ数列は40個で止めて残りは頻度1にする
+            // 7個おきに頻度0のシンボルを混ぜる
+            freq[i] = i % 7 == 3 ? 0 : a;
+            if (freq[i]) used++;
+            if (i < 40) {
+                long next = a + b;
+                a = b;
+                b = next;
+            }
+        }
+
+        JpegEncoder_HuffmanSpec spec;
+        JpegEncoder_buildOptimalSpec(freq, symbolCount, &spec);
+
+        int total = 0;
+        long kraft = 0;  // 2^-16を単位としたクラフト和
+        for (int length = 1; length <= 16; length++) {
+            total += spec.bits[length - 1];
+            kraft += (long)spec.bits[length - 1] << (16 - length);
+        }
+        int seen[256] = { 0 }, distinct = 1;
+        for (int i = 0; i < spec.count; i++) {
+            if (seen[spec.values[i]]++ || freq[spec.values[i]] == 0) distinct = 0;
+        }
+
+        if (total != spec.count || spec.count != used || kraft >= 65536 || !distinct) {
+            if (ok) snprintf(detail, sizeof(detail), "%d symbols: %d lengths for %d codes (%d used), Kraft %ld/65536",
+                             symbolCount, total, spec.count, used, kraft);
+            ok = 0;
+        }
+    }
+
+    if (ok) snprintf(detail, sizeof(detail), "all lengths <= 16, Kraft sum < 1");
+    report(ok, "optimal Huffman lengths", "fibonacci", detail);
+}
+
+// 最適化ハフマンテーブル（-o）の出力サイズが標準テーブル以下であることの確認（全サブサンプリング）
+void testOptimizeHuffman(const unsigned char* bgr, int width, int height, const char* image) {
+    int ok = 1;
+    char detail[256] = "";
+    long standardTotal = 0, optimizedTotal = 0;
+
+    for (int subsampling = JPEG_SUBSAMPLING_420; subsampling <= JPEG_SUBSAMPLING_GRAY; subsampling++) {
+        JpegEncoder* encoder = JpegEncoder_create();
+        JpegEncoder_Sink standard, optimized;
+        JpegEncoder_initSink(&standard, NULL, 0);
+        JpegEncoder_initSink(&optimized, NULL, 0);
+
+        int success = encoder && JpegEncoder_setQuality(encoder, TEST_ENCODE_QUALITY) &&
+                      JpegEncoder_setSubsampling(encoder, subsampling) &&
+                      JpegEncoder_encode(encoder, bgr, width, height, width * 3, &standard);
+        if (success) {
+            JpegEncoder_setOptimizeHuffman(encoder, 1);
+            success = JpegEncoder_encode(encoder, bgr, width, height, width * 3, &optimized);
+        }
+        if (!success || optimized.size > standard.size) {
+            if (ok) snprintf(detail, sizeof(detail), "%s: %zu bytes optimized, %zu bytes standard%s", SubsamplingNames[subsampling],
+                             optimized.size, standard.size, success ? "" : " (encode failed)");
+            ok = 0;
+        }
+        standardTotal += (long)standard.size;
+        optimizedTotal += (long)optimized.size;
+
+        JpegEncoder_freeSink(&standard);
+        JpegEncoder_freeSink(&optimized);
+        JpegEncoder_destroy(encoder);
+    }
+
+    if (ok) snprintf(detail, sizeof(detail), "%ld bytes optimized, %ld bytes standard", optimizedTotal, standardTotal);
+    report(ok, "optimized Huffman <= standard", image, detail);
+}
+
+// 出力のチェックサム（FNV-1a 64bit）
+uint64_t checksum(const unsigned char* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// 設定どおりにエンコードし、出力のチェックサムを返す
+// カーネルがこのCPUで使えなければ-1、エンコードに失敗すれば0を返す
+int64_t encodeChecksum(const unsigned char* bgr, int width, int height, int subsampling, const TestConfig* config) {
+    if (!JpegEncoder_initKernels(config->kernel)) return -1;
+
+    JpegEncoder* encoder = JpegEncoder_create();
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
+    int success = encoder && JpegEncoder_setQuality(encoder, TEST_ENCODE_QUALITY) &&
+                  JpegEncoder_setSubsampling(encoder, subsampling) &&
+                  JpegEncoder_setThreadCount(encoder, config->threadCount) &&
+                  JpegEncoder_setRestartInterval(encoder, config->restartInterval) &&
+                  JpegEncoder_setFlatBlockThreshold(encoder, config->flatThreshold) &&
+                  JpegEncoder_setMCUCache(encoder, config->cacheEntries);
+    if (success) JpegEncoder_setParallelMode(encoder, config->parallelMode);
+    for (int i = 0; success && i <= config->warmEncodes; i++) {
+        sink.size = 0;
+        if (config->streaming) {
+            success = JpegEncoder_beginStream(encoder, width, height, &sink);
+            for (int yPos = 0; success && yPos < height; yPos += 16) {
+                success = JpegEncoder_writeStrip(encoder, bgr + (size_t)yPos * width * 3, width * 3, &sink);
+            }
+            success = success && JpegEncoder_endStream(encoder, &sink);
+        } else {
+            success = JpegEncoder_encode(encoder, bgr, width, height, width * 3, &sink);
+        }
+    }
+
+    int64_t result = success ? (int64_t)(checksum(sink.data, sink.size) >> 1) | 1 : 0;
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_destroy(encoder);
+    JpegEncoder_initKernels("scalar");
+    return result;
+}
+
+// 設定ごとの出力が基準のエンコードとビット単位で一致するかの確認（全サブサンプリング）
+void testIdentity(const char* test, const TestConfig* configs, int configCount, const unsigned char* bgr, int width, int height, const char* image) {
+    int compared = 0, skipped = 0, ok = 1;
+    char detail[256] = "";
+
+    for (int subsampling = JPEG_SUBSAMPLING_420; subsampling <= JPEG_SUBSAMPLING_GRAY; subsampling++) {
+        for (int i = 0; i < configCount; i++) {
+            const TestConfig* config = &configs[i];
+            TestConfig baseline = { "baseline", "scalar", 1, JPEG_PARALLEL_SEGMENTS, config->restartInterval, JPEG_FLAT_BLOCKS_OFF, 0, 0, 0 };
+
+            int64_t expected = encodeChecksum(bgr, width, height, subsampling, &baseline);
+            int64_t actual = encodeChecksum(bgr, width, height, subsampling, config);
+            if (actual < 0) {
+                skipped++;
+            } else if (expected == 0 || actual != expected) {
+                if (ok) snprintf(detail, sizeof(detail), "%s differs at %s", config->name, SubsamplingNames[subsampling]);
+                ok = 0;
+            } else {
+                compared++;
+            }
+        }
+    }
+
+    if (ok) snprintf(detail, sizeof(detail), "%d encodes identical, %d skipped (unsupported kernel)", compared, skipped);
+    report(ok, test, image, detail);
+}
+
+// プレーンの論理行rowの先頭（flipなら下から上の行順で格納している）
+static unsigned char* planeRow(unsigned char* plane, int rows, int rowBytes, int row, int flip) {
+    return plane + (size_t)(flip ? rows - 1 - row : row) * rowBytes;
+}
+
+// テスト画像から指定した画素形式のフレームを作る
+// YUVのYは色空間変換と同じ式で求め、U/Vは2x2ピクセルの左上の画素のCb/Crを使う（YUYVは縦に2行ずつ同じU/Vを持つ）
+// flipなら各プレーンを下から上の行順で格納し、ストライドを負にする。返したバッファは呼び出し側で解放する
+unsigned char* makeFrame(const unsigned char* bgr, int width, int height, int format, int flip, JpegEncoder_Frame* frame) {
+    int rowBytes[3] = { width * 3, 0, 0 }, rows[3] = { height, height / 2, height / 2 };
+    int planeCount = 1;
+    if (format == JPEG_PIXEL_BGRX || format == JPEG_PIXEL_RGBA) rowBytes[0] = width * 4;
+    if (format == JPEG_PIXEL_I420) {
+        rowBytes[0] = width;
+        rowBytes[1] = rowBytes[2] = width / 2;
+        planeCount = 3;
+    }
+    if (format == JPEG_PIXEL_NV12) {
+        rowBytes[0] = rowBytes[1] = width;
+        planeCount = 2;
+    }
+    if (format == JPEG_PIXEL_YUYV) rowBytes[0] = width * 2;
+
+    size_t size = 0;
+    for (int i = 0; i < planeCount; i++) size += (size_t)rowBytes[i] * rows[i];
+    unsigned char* data = (unsigned char*)malloc(size);
+    if (!data) return NULL;
+
+    unsigned char* planes[3] = { data, NULL, NULL };
+    for (int i = 1; i < planeCount; i++) planes[i] = planes[i - 1] + (size_t)rowBytes[i - 1] * rows[i - 1];
+    memset(frame, 0, sizeof(*frame));
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    for (int i = 0; i < planeCount; i++) {
+        frame->planes[i] = planeRow(planes[i], rows[i], rowBytes[i], 0, flip);
+        frame->strides[i] = flip ? -rowBytes[i] : rowBytes[i];
+    }
+
+    for (int y = 0; y < height; y++) {
+        unsigned char* out = planeRow(planes[0], rows[0], rowBytes[0], y, flip);
+        for (int x = 0; x < width; x++) {
+            const unsigned char* p = bgr + ((size_t)y * width + x) * 3;
+            const unsigned char* c = bgr + ((size_t)(y & ~1) * width + (x & ~1)) * 3;  // U/Vを取る2x2ピクセルの左上
+            int B = p[0], G = p[1], R = p[2];
+            int Y = (76 * R + 150 * G + 29 * B) >> 8;
+            int U = ((-43 * c[2] - 85 * c[1] + 128 * c[0]) >> 8) + 128;
+            int V = ((128 * c[2] - 107 * c[1] - 21 * c[0]) >> 8) + 128;
+
+            switch (format) {
+            case JPEG_PIXEL_BGR: memcpy(out + x * 3, p, 3); break;
+            case JPEG_PIXEL_BGRX: out[x * 4] = (unsigned char)B; out[x * 4 + 1] = (unsigned char)G; out[x * 4 + 2] = (unsigned char)R; out[x * 4 + 3] = 0x5A; break;
+            case JPEG_PIXEL_RGBA: out[x * 4] = (unsigned char)R; out[x * 4 + 1] = (unsigned char)G; out[x * 4 + 2] = (unsigned char)B; out[x * 4 + 3] = 0xA5; break;
+            case JPEG_PIXEL_YUYV:
+                out[x * 2] = (unsigned char)Y;
+                out[x * 2 + 1] = (unsigned char)(x & 1 ? V : U);
+                break;
+            default:  // I420、NV12
+                out[x] = (unsigned char)Y;
+                if ((x & 1) == 0 && (y & 1) == 0) {
+                    if (format == JPEG_PIXEL_I420) {
+                        planeRow(planes[1], rows[1], rowBytes[1], y / 2, flip)[x / 2] = (unsigned char)U;
+                        planeRow(planes[2], rows[2], rowBytes[2], y / 2, flip)[x / 2] = (unsigned char)V;
+                    } else {
+                        unsigned char* uv = planeRow(planes[1], rows[1], rowBytes[1], y / 2, flip);
+                        uv[x] = (unsigned char)U;
+                        uv[x + 1] = (unsigned char)V;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return data;
+}
+
+// フレームをエンコードし、出力のチェックサムを返す（失敗すれば0）
+int64_t encodeFrameChecksum(const JpegEncoder_Frame* frame, int subsampling) {
+    JpegEncoder* encoder = JpegEncoder_create();
+    JpegEncoder_Sink sink;
+    JpegEncoder_initSink(&sink, NULL, 0);
+    int success = encoder && JpegEncoder_setQuality(encoder, TEST_ENCODE_QUALITY) &&
+                  JpegEncoder_setSubsampling(encoder, subsampling) &&
+                  JpegEncoder_encodeFrame(encoder, frame, &sink);
+    int64_t result = success ? (int64_t)(checksum(sink.data, sink.size) >> 1) | 1 : 0;
+    JpegEncoder_freeSink(&sink);
+    JpegEncoder_destroy(encoder);
+    return result;
+}
+
+// 画素形式ごとの出力の比較（全サブサンプリング、上から下と下から上の行順）
+// BGRX/RGBAは同じ画像のBGRと、NV12/YUYVは同じY/U/Vの標本を持つI420と、ビット単位で一致すること
+void testFrameFormats(const unsigned char* bgr, int width, int height, const char* image) {
+    static const int formats[] = { JPEG_PIXEL_BGR, JPEG_PIXEL_BGRX, JPEG_PIXEL_RGBA, JPEG_PIXEL_I420, JPEG_PIXEL_NV12, JPEG_PIXEL_YUYV };
+    static const char* const formatNames[] = { "bgr", "bgrx", "rgba", "i420", "nv12", "yuyv" };  // JPEG_PIXEL_xxxの順
+    int compared = 0, ok = 1;
+    char detail[256] = "";
+
+    for (int subsampling = JPEG_SUBSAMPLING_420; subsampling <= JPEG_SUBSAMPLING_GRAY; subsampling++) {
+        int64_t expected[2] = { 0, 0 };  // BGRとI420の上から下の行順での出力
+        for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++) {
+            int format = formats[f];
+            int yuv = format >= JPEG_PIXEL_I420;
+            for (int flip = 0; flip < 2; flip++) {
+                JpegEncoder_Frame frame;
+                unsigned char* data = makeFrame(bgr, width, height, format, flip, &frame);
+                int64_t actual = data ? encodeFrameChecksum(&frame, subsampling) : 0;
+                free(data);
+
+                if (!expected[yuv]) {
+                    expected[yuv] = actual;
+                } else {
+                    compared++;
+                }
+                if (actual == 0 || actual != expected[yuv]) {
+                    if (ok) snprintf(detail, sizeof(detail), "%s%s differs from %s at %s", formatNames[format], flip ? " bottom-up" : "",
+                                     yuv ? "i420" : "bgr", SubsamplingNames[subsampling]);
+                    ok = 0;
+                }
+            }
+        }
+    }
+
+    if (ok) snprintf(detail, sizeof(detail), "%d encodes identical", compared);
+    report(ok, "frame formats", image, detail);
+}
+
+// メインプログラム
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);  // 結果の行とライブラリのエラー表示（stderr）の順序を保つ
+    if (!JpegEncoder_initKernels("scalar")) return 1;
+    testOptimalSpec();
+
+    for (int s = 0; s < TEST_SIZE_COUNT; s++) {
+        int width = TestSizes[s][0], height = TestSizes[s][1];
+        unsigned char* bgr = (unsigned char*)malloc((size_t)width * height * 3);
+        if (!bgr) {
+            fprintf(stderr, "Error: Cannot allocate test image\n");
+            return 1;
+        }
+
+        for (int pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+            char image[64];
+            snprintf(image, sizeof(image), "%s %dx%d", PatternNames[pattern], width, height);
+            generatePattern(pattern, width, height, bgr);
+
+            testFastDCT(bgr, width, height, image);
+            testConvert(bgr, width, height, image);
+            testEncodeToSize(bgr, width, height, image);
+            testOptimizeHuffman(bgr, width, height, image);
+            testFrameFormats(bgr, width, height, image);
+            testIdentity("kernels vs scalar", KernelConfigs, TEST_CONFIG_COUNT(KernelConfigs), bgr, width, height, image);
+            testIdentity("parallel/streaming vs serial", ParallelConfigs, TEST_CONFIG_COUNT(ParallelConfigs), bgr, width, height, image);
+            testIdentity("flat threshold 0 vs off", FlatConfigs, TEST_CONFIG_COUNT(FlatConfigs), bgr, width, height, image);
+            testIdentity("MCU cache vs no cache", CacheConfigs, TEST_CONFIG_COUNT(CacheConfigs), bgr, width, height, image);
+        }
+        free(bgr);
+    }
+
+    if (testFailures) {
+        printf("%d test(s) failed\n", testFailures);
+        return 1;
+    }
+    printf("All tests passed\n");
+    return 0;
+}
@@ -0,0 +1,3510 @@
+/*
+JPEG Encoder Library
+jpeg_encoder_3のエンコーダをライブラリ化したもの（4:2:0、4:2:2、4:4:4、グレースケール）
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JPEG_ENCODER_X86
+#endif
+
+#include "jpegenc.h"
+
+#define PI 3.1415926f
+
+// 高速DCTの固定小数点パラメータ
+#define DCT_CONST_BITS 13
+#define DCT_PASS1_BITS 2
+#define DCT_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+#define FIX_0_298631336 2446
+#define FIX_0_390180644 3196
+#define FIX_0_541196100 4433
+#define FIX_0_765366865 6270
+#define FIX_0_899976223 7373
+#define FIX_1_175875602 9633
+#define FIX_1_501321110 12299
+#define FIX_1_847759065 15137
+#define FIX_1_961570560 16069
+#define FIX_2_053119869 16819
+#define FIX_2_562915447 20995
+#define FIX_3_072711026 25172
+
+// 逆数乗算による量子化のシフト量
+// 除数 8*Q <= 2040 < 2^11、被除数 < 2^15 の範囲で整数除算と一致する
+#define QUANT_RECIP_SHIFT 26
+
+// SOFに書き込める画像の幅と高さの上限
+#define JPEG_MAX_DIMENSION 65535
+
+// 品質の既定値
+#define JPEG_DEFAULT_QUALITY 75
+
+// 符号表の大きさ（DC差分は±2047、AC係数は±1023）
+#define JPEG_DC_CODES 4096
+#define JPEG_AC_CODES (16 * 2048)
+
+// 処理段階ごとの計測（JPEG_ENCODER_PROFILEを定義してビルドした場合のみ）
+// 各スレッドはスレッドローカルの集計に加算し、処理の終わりにエンコーダの集計へまとめる
+// 定義しない場合はマクロが空になり、計測のコードは一切残らない
+enum {
+    JPEG_STAGE_CONVERT,   // 色空間変換
+    JPEG_STAGE_DCT,
+    JPEG_STAGE_QUANTIZE,
+    JPEG_STAGE_ZIGZAG,
+    JPEG_STAGE_HUFFMAN,   // ハフマン符号化（ビット列の書き出しを含む）
+    JPEG_STAGE_WRITE,     // ビット列の書き出し（バイト詰めを含む）
+    JPEG_STAGE_COUNT
+};
+
+#ifdef JPEG_ENCODER_PROFILE
+typedef struct {
+    uint64_t time[JPEG_STAGE_COUNT];   // rdtscのサイクル数（x86以外はナノ秒）
+    uint64_t calls[JPEG_STAGE_COUNT];
+    uint64_t blocks;                   // ハフマン符号化したブロック数
+    uint64_t flatBlocks;               // DCTを省いた平坦ブロック数
+    uint64_t nonzeroCoefficients;      // 非ゼロ係数の総数
+    uint64_t huffmanBits;              // ハフマン符号と付加ビットの総ビット数
+    uint64_t stuffedBytes;             // 0xFFの後に挿入した0x00の数
+} JpegEncoder_Profile;
+
+#define JPEG_PROFILE_BEGIN(name) uint64_t name = JpegEncoder_readTimer()
+#define JPEG_PROFILE_END(name, stage) JpegEncoder_addStageTime((stage), (name))
+#define JPEG_PROFILE_COUNT(field, n) (JpegEncoder_threadProfile.field += (uint64_t)(n))
+#define JPEG_PROFILE_RESET(encoder) memset(&(encoder)->profile, 0, sizeof((encoder)->profile))
+#define JPEG_PROFILE_MERGE(encoder) JpegEncoder_mergeProfile(&(encoder)->profile)
+#define JPEG_PROFILE_DUMP(encoder) JpegEncoder_dumpProfile(encoder)
+#else
+#define JPEG_PROFILE_BEGIN(name)
+#define JPEG_PROFILE_END(name, stage)
+#define JPEG_PROFILE_COUNT(field, n)
+#define JPEG_PROFILE_RESET(encoder)
+#define JPEG_PROFILE_MERGE(encoder)
+#define JPEG_PROFILE_DUMP(encoder)
+#endif
+
+// 構造体定義
+typedef struct {
+    int length;
+    int value;
+} BitString;
+
+// ビット書き込み状態（64bitアキュムレータ）
+typedef struct {
+    uint64_t buffer;  // 未出力のビット（下位詰め）
+    int freeBits;     // bufferの空きビット数
+    int stuffBytes;   // 1: 0xFFの後に0x00を挿入する（0なら詰めずにそのまま書き出す）
+} JpegEncoder_BitWriter;
+
+// 品質ごとの量子化テーブル
+typedef struct {
+    unsigned char YTable[64];     // DQTに書き込む値（ジグザグ順）
+    unsigned char CbCrTable[64];
+    uint32_t YRecip[64];          // YTableの逆数（自然順、高速DCTの8倍スケール込み）
+    uint32_t CbCrRecip[64];       // CbCrTableの逆数
+} JpegEncoder_QuantTables;
+
+// 量子化前のDCT係数（高速DCTの出力、自然順）
+// 成分ごとにブロックを並べて持つ（YはMCUごとにサブサンプリングに応じた数、グレースケールではCb/CrはNULL）
+struct JpegEncoder_Coefficients {
+    int width;
+    int height;
+    int mcuCount;
+    int subsampling;  // 解析時のサブサンプリング
+    int16_t (*yBlocks)[64];
+    int16_t (*cbBlocks)[64];
+    int16_t (*crBlocks)[64];
+};
+
+// ハフマンテーブルの定義（DHTに書き込む内容）
+typedef struct {
+    unsigned char bits[16];     // 符号長1～16ごとの符号数
+    unsigned char values[256];  // 符号長の短い順に並べたシンボル
+    int count;                  // シンボル数
+} JpegEncoder_HuffmanSpec;
+
+// ハフマンテーブルの種類（DHTに書き込む順）
+enum { JPEG_HUFFMAN_Y_DC, JPEG_HUFFMAN_Y_AC, JPEG_HUFFMAN_CBCR_DC, JPEG_HUFFMAN_CBCR_AC, JPEG_HUFFMAN_TABLES };
+
+// スキャンの符号化状態（DC予測値とビット書き込み状態）
+typedef struct {
+    short prev_DC_Y;
+    short prev_DC_Cb;
+    short prev_DC_Cr;
+    JpegEncoder_BitWriter writer;
+} JpegEncoder_ScanState;
+
+// 1MCUの最大ブロック数（4:2:0のY 4ブロック、Cb、Cr）
+#define JPEG_MAX_BLOCKS 6
+
+// MCUの構成（サブサンプリングごとに1つ）
+// 処理関数はJPEG_DEFINE_MCUでブロック数などを定数にして生成したもの
+typedef struct {
+    const char* name;
+    int mcuWidth;             // MCUの画素数（横）
+    int mcuHeight;            // MCUの画素数（縦）
+    int yBlocks;              // MCU内のYブロック数
+    int blockCount;           // MCU内の全ブロック数（Yブロック、Cb、Crの順）
+    int components;           // 1: Yのみ、3: YCbCr
+    unsigned char ySampling;  // SOFに書き込むYの標本化係数（(H << 4) | V）
+    void (*convert)(const JpegEncoder* encoder, int mcu, char (*blocks)[64]);
+    void (*transform)(JpegEncoder* encoder, int mcu, short (*coef)[64], uint64_t* mask);
+    void (*huffman)(JpegEncoder* encoder, JpegEncoder_ScanState* state, short (*coef)[64], const uint64_t* mask, JpegEncoder_Sink* sink);
+    void (*encode)(JpegEncoder* encoder, JpegEncoder_ScanState* state, int firstMCU, int lastMCU, JpegEncoder_Sink* sink);
+} JpegEncoder_Layout;
+
+// エンコード済みMCUのキャッシュのキーの最大バイト数（4:2:0のBGRX/RGBAの16x16画素）
+#define JPEG_MCU_KEY_BYTES 1024
+
+// エンコード済みMCUのキャッシュの1項目
+typedef struct {
+    uint64_t hash;
+    int keySize;
+    int hashNext;  // 同じバケットの次の項目（-1で終わり）
+    int lruPrev;   // LRUリストの前後の項目（先頭ほど最近使った、-1で終わり）
+    int lruNext;
+    unsigned char key[JPEG_MCU_KEY_BYTES];  // MCUの入力画素（ハッシュが一致したときに比較する）
+    short coef[JPEG_MAX_BLOCKS][64];        // layout->transformの出力
+    uint64_t mask[JPEG_MAX_BLOCKS];
+} JpegEncoder_MCUCacheEntry;
+
+// エンコード済みMCUのキャッシュ（ハッシュ表とLRUリスト）
+// 並列エンコードでは複数のスレッドから使うので、操作はlockの中で行う
+typedef struct {
+    pthread_mutex_t lock;
+    JpegEncoder_MCUCacheEntry* entries;  // capacity個
+    int* buckets;                        // 各バケットの先頭の項目（-1で空）
+    int bucketMask;                      // バケット数 - 1（バケット数は2の累乗）
+    int capacity;
+    int count;                           // 使用中の項目数
+    int lruHead;
+    int lruTail;
+    // 保持している係数を作ったときの設定（変わったら全項目を捨てる）
+    const JpegEncoder_QuantTables* quantTables;
+    int subsampling;
+    int dctMethod;
+    int flatThreshold;
+    int format;
+    JpegEncoder_MCUCacheStats stats;
+} JpegEncoder_MCUCache;
+
+struct JpegEncoder {
+    int width;
+    int height;
+    JpegEncoder_Frame frame;  // 入力画素（planes[0]がNULLなら画素の入力はない）
+    int frameRow;             // frameの一番上の行の画像上の位置（ストリーミングエンコードではストリップの先頭行）
+    const JpegEncoder_QuantTables* quantTables;  // 品質ごとのキャッシュ（プロセス全体で共有）
+    int quality;
+    JpegEncoder_HuffmanSpec huffmanSpecs[JPEG_HUFFMAN_TABLES];
+    int standardHuffman;  // 1: huffmanSpecsはAnnex Kの標準テーブル
+    int optimizeHuffman;  // 1: 画像ごとに最適化したハフマンテーブルを使う
+    short (*coefCache)[64];  // 最適化時の量子化済み係数（MCUごとにlayout->blockCount個、ジグザグ順）
+    uint64_t* maskCache;     // coefCacheの各ブロックの非ゼロ係数のビットマスク
+    const JpegEncoder_Coefficients* dctSource;  // 画素の代わりに使う量子化前の係数
+    BitString Y_DC_Huffman_Table[12];
+    BitString Y_AC_Huffman_Table[256];
+    BitString CbCr_DC_Huffman_Table[12];
+    BitString CbCr_AC_Huffman_Table[256];
+    // ハフマン符号と付加ビットをつなげた符号表（(ビット列 << 5) | ビット長）
+    // DCは差分の下位12bit、ACは(ゼロの連続長 << 11) | 係数の下位11bitで引く
+    uint32_t Y_DC_Codes[JPEG_DC_CODES];
+    uint32_t Y_AC_Codes[JPEG_AC_CODES];
+    uint32_t CbCr_DC_Codes[JPEG_DC_CODES];
+    uint32_t CbCr_AC_Codes[JPEG_AC_CODES];
+    int dctMethod;
+    int flatThreshold;    // 平坦ブロックとみなす画素値の幅（0なら完全に一様なブロックのみ、負なら無効）
+    int restartInterval;  // リスタートインターバル（MCU数、0なら無効、JPEG_RESTART_MCU_ROWなら1MCU行）
+    int restartMCUs;      // エンコード中の画像に対する実際のリスタートインターバル
+    int threadCount;      // エンコードに使うスレッド数
+    int parallelMode;     // リスタートインターバルがない場合の並列化の方法
+    int subsampling;      // クロマサブサンプリング
+    const JpegEncoder_Layout* layout;  // subsamplingに対応するMCUの構成
+    JpegEncoder_MCUCache* mcuCache;    // エンコード済みMCUのキャッシュ（NULLなら使わない）
+    JpegEncoder_ScanState scan;  // ストリーミングエンコードの状態
+    int nextRow;                 // ストリーミングエンコードで次に受け取る行
+#ifdef JPEG_ENCODER_PROFILE
+    JpegEncoder_Profile profile;  // 直近のエンコードの計測結果
+#endif
+};
+
+// 並列エンコードの作業単位（連続したリスタートインターバルの組）
+typedef struct {
+    JpegEncoder* encoder;
+    JpegEncoder_Sink* sinks;  // 作業単位ごとの出力先
+    int chunkCount;
+    int mcusPerChunk;         // リスタートインターバルの倍数
+    int mcuCount;
+    int nextChunk;            // 次に処理する作業単位（スレッド間で共有）
+} JpegEncoder_Job;
+
+// 行並列エンコードの区間（連続したMCU行）
+// 1回目の並列処理でバイト詰めなしのビット列を作り、2回目でビット位置をずらしてバイト詰めする
+// 先頭のMCUは前の区間のDC予測値が必要なので、1回目では係数だけを求め、1回目の後で符号化する
+typedef struct {
+    short headCoef[JPEG_MAX_BLOCKS][64];  // 先頭のMCUの係数（最初の区間では使わない）
+    uint64_t headMask[JPEG_MAX_BLOCKS];
+    JpegEncoder_Sink head;  // 先頭のMCUのビット列（最初の区間では空）
+    size_t headLength;      // headの正確なビット長
+    JpegEncoder_Sink bits;  // 先頭以外のMCUの、0xFFの後に0x00を挿入していないビット列（どちらも末尾は0で埋めてある）
+    size_t bitLength;       // 区間の正確なビット長（head、bitsの順につなげたもの）
+    size_t bitOffset;       // スキャンの先頭からのビット位置
+    short lastDC[3];        // 区間の最後のMCUの後のDC予測値（Y、Cb、Cr）
+    JpegEncoder_Sink out;   // バイト境界にそろえてバイト詰めした出力
+} JpegEncoder_Segment;
+
+typedef struct {
+    JpegEncoder* encoder;
+    JpegEncoder_Segment* segments;
+    int segmentCount;
+    int mcusPerSegment;  // MCU行の倍数
+    int mcuCount;
+    int nextSegment;     // 次に処理する区間（スレッド間で共有）
+} JpegEncoder_SegmentJob;
+
+// パイプライン並列エンコードでステージ間を受け渡すMCUの組
+#define JPEG_PIPELINE_BATCH 16  // 1組のMCU数
+#define JPEG_PIPELINE_SLOTS 8   // リングバッファの組数（2の累乗）
+
+typedef struct {
+    short coef[JPEG_PIPELINE_BATCH * JPEG_MAX_BLOCKS][64];  // layout->transformの出力（MCUごとにlayout->blockCount個）
+    uint64_t mask[JPEG_PIPELINE_BATCH * JPEG_MAX_BLOCKS];
+} JpegEncoder_Batch;
+
+// パイプライン並列エンコードの状態
+// 変換ステージ（1スレッド）がリングバッファに書き込み、符号化ステージ（1スレッド）が読み出す
+// produced/consumedはそれぞれ片方のスレッドだけが書き換えるのでロックは不要
+typedef struct {
+    JpegEncoder* encoder;
+    JpegEncoder_Batch* slots;  // JPEG_PIPELINE_SLOTS組のリングバッファ
+    int mcuCount;
+    int batchCount;
+    int produced;              // 変換済みの組数（変換ステージが更新）
+    char padding[64];          // produced/consumedを別のキャッシュラインに置く
+    int consumed;              // 符号化済みの組数（符号化ステージが更新）
+} JpegEncoder_Pipeline;
+
+// 定数テーブル
+static const unsigned char Luminance_Quantization_Table[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99
+};
+
+static const unsigned char Chrominance_Quantization_Table[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+static const unsigned char ZigZag[64] = {
+    0, 1, 5, 6, 14, 15, 27, 28,
+    2, 4, 7, 13, 16, 26, 29, 42,
+    3, 8, 12, 17, 25, 30, 41, 43,
+    9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54,
+    20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61,
+    35, 36, 48, 49, 57, 58, 62, 63
+};
+
+static const unsigned char Standard_DC_Luminance_NRCodes[] = { 0, 0, 7, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char Standard_DC_Luminance_Values[] = { 4, 5, 3, 2, 6, 1, 0, 7, 8, 9, 10, 11 };
+
+static const unsigned char Standard_DC_Chrominance_NRCodes[] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char Standard_DC_Chrominance_Values[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const unsigned char Standard_AC_Luminance_NRCodes[] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char Standard_AC_Luminance_Values[] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+static const unsigned char Standard_AC_Chrominance_NRCodes[] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char Standard_AC_Chrominance_Values[] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+// ブロック処理カーネル（色空間変換、高速DCT、量子化、ジグザグ）
+// 色空間変換はサブサンプリングごとに1つずつ（convertは4:2:0）
+typedef struct {
+    const char* name;
+    void (*convert)(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+    void (*convert422)(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+    void (*convert444)(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+    void (*convertGray)(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+    void (*dct)(const char* channel_data, int32_t* dct_data);
+    void (*quantize)(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip);
+    uint64_t (*zigzag)(const short* quant_data, short* fdc_data);  // 非ゼロ係数のビットマスクを返す
+} JpegEncoder_Kernels;
+
+// コサインテーブル（cos((2x+1)uπ/16) * 16384）
+static const int16_t cos_table[8][8] = {
+    {16384, 16069, 15137, 13623, 11585, 9102, 6270, 3196},
+    {16384, 13623, 6270, -3196, -11585, -16069, -15137, -9102},
+    {16384, 9102, -6270, -16069, -11585, 3196, 15137, 13623},
+    {16384, 3196, -15137, -9102, 11585, 13623, -6270, -16069},
+    {16384, -3196, -15137, 9102, 11585, -13623, -6270, 16069},
+    {16384, -9102, -6270, 16069, -11585, -3196, 15137, -13623},
+    {16384, -13623, 6270, 3196, -11585, 16069, -15137, 9102},
+    {16384, -16069, 15137, -13623, 11585, -9102, 6270, -3196}
+};
+
+// 選択中のカーネル（JpegEncoder_initKernelsで設定）
+static JpegEncoder_Kernels JpegEncoder_kernels = { "scalar", NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+// 関数プロトタイプ（公開関数はjpegenc.h、ここに並べる内部関数はすべてstaticにしてライブラリの外に出さない）
+static void JpegEncoder_initHuffmanTables(JpegEncoder* encoder);
+static void JpegEncoder_initDefaultKernels(void);
+static int JpegEncoder_reserveSink(JpegEncoder_Sink* sink, size_t byteSize);
+static void JpegEncoder_computeHuffmanTable(const unsigned char* nr_codes, const unsigned char* std_table, BitString* huffman_table);
+static BitString JpegEncoder_getBitCode(int value);
+static void JpegEncoder_write_byte(unsigned char value, JpegEncoder_Sink* sink);
+static void JpegEncoder_write_word(unsigned short value, JpegEncoder_Sink* sink);
+static void JpegEncoder_write(const void* p, size_t byteSize, JpegEncoder_Sink* sink);
+static void JpegEncoder_doHuffmanEncoding(const short* DU, uint64_t nonzeroMask, short* prevDC, const uint32_t* DCCodes, const uint32_t* ACCodes, JpegEncoder_BitWriter* writer, JpegEncoder_Sink* sink);
+static void JpegEncoder_initCodeTable(const BitString* HTDC, const BitString* HTAC, uint32_t* DCCodes, uint32_t* ACCodes);
+static void JpegEncoder_setStandardHuffmanSpecs(JpegEncoder* encoder);
+static void JpegEncoder_setHuffmanSpec(JpegEncoder_HuffmanSpec* spec, const unsigned char* bits, const unsigned char* values);
+static void JpegEncoder_countSymbols(const short* DU, uint64_t nonzeroMask, short* prevDC, long* dcFreq, long* acFreq);
+static void JpegEncoder_buildOptimalSpec(const long* symbolFreq, int symbolCount, JpegEncoder_HuffmanSpec* spec);
+static int JpegEncoder_optimizeHuffmanTables(JpegEncoder* encoder, int mcuCount);
+static uint64_t JpegEncoder_requantize(const int16_t* dct_block, short* fdc_data, const uint32_t* quant_recip);
+static int JpegEncoder_encodeScan(JpegEncoder* encoder, JpegEncoder_Sink* sink);
+static void JpegEncoder_write_bitbuffer(uint64_t buffer, int stuffBytes, JpegEncoder_Sink* sink);
+static void JpegEncoder_flush_bitstring(JpegEncoder_BitWriter* writer, JpegEncoder_Sink* sink);
+static void JpegEncoder_convertColorSpace(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static uint64_t JpegEncoder_foword_FDC(const char* channel_data, short* fdc_data, const unsigned char* quant_table, const uint32_t* quant_recip, int dctMethod);
+static uint64_t JpegEncoder_transformBlock(const JpegEncoder* encoder, const char* channel_data, short* fdc_data, const unsigned char* quant_table, const uint32_t* quant_recip);
+static int JpegEncoder_flatBlockDC(const char* channel_data, int threshold, int32_t* dc);
+static uint64_t JpegEncoder_quantizeFlat(int32_t dc, short* fdc_data, const uint32_t* quant_recip);
+static void JpegEncoder_DCT(const char* channel_data, int64_t* dct_data);
+static void JpegEncoder_Quantize(const int64_t* dct_data, short* quant_data, const unsigned char* quant_table);
+static void JpegEncoder_DCT_fast(const char* channel_data, int32_t* dct_data);
+static void JpegEncoder_Quantize_fast(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip);
+static uint64_t JpegEncoder_ZigZag(const short* quant_data, short* fdc_data);
+static void JpegEncoder_initQuantRecip(const unsigned char* quant_table, uint32_t* quant_recip);
+static const JpegEncoder_QuantTables* JpegEncoder_getQuantTables(int quality);
+static void JpegEncoder_initQualityTables(JpegEncoder_QuantTables* tables, int quality);
+#ifdef JPEG_ENCODER_X86
+static void JpegEncoder_DCT_avx2(const char* channel_data, int32_t* dct_data);
+static void JpegEncoder_Quantize_avx2(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip);
+static void JpegEncoder_DCT_sse41(const char* channel_data, int32_t* dct_data);
+static void JpegEncoder_Quantize_sse41(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip);
+static uint64_t JpegEncoder_ZigZag_sse41(const short* quant_data, short* fdc_data);
+static void JpegEncoder_convertColorSpace_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static void JpegEncoder_convertColorSpace_422_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static void JpegEncoder_convertColorSpace_444_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static void JpegEncoder_convertColorSpace_gray_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+#endif
+static void JpegEncoder_write_jpeg_header(JpegEncoder* encoder, JpegEncoder_Sink* sink);
+static void JpegEncoder_initScanState(JpegEncoder_ScanState* state);
+static void JpegEncoder_encodeMCUs(JpegEncoder* encoder, JpegEncoder_ScanState* state, int firstMCU, int lastMCU, JpegEncoder_Sink* sink);
+static void* JpegEncoder_pipelineWorker(void* arg);
+static int JpegEncoder_encodePipelined(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink);
+static void JpegEncoder_backoff(int spins);
+static void* JpegEncoder_segmentWorker(void* arg);
+static void* JpegEncoder_mergeWorker(void* arg);
+static int JpegEncoder_encodeSegments(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink);
+static void JpegEncoder_encodeSegmentHead(JpegEncoder* encoder, JpegEncoder_Segment* segment, const JpegEncoder_Segment* prev);
+static size_t JpegEncoder_finishBits(JpegEncoder_BitWriter* writer, JpegEncoder_Sink* bits);
+static uint32_t JpegEncoder_segmentBits(const JpegEncoder_Segment* segment, size_t pos, int count);
+static uint32_t JpegEncoder_readBits(const unsigned char* data, size_t pos, int count);
+static void JpegEncoder_runWorkers(void* (*worker)(void*), void* arg, int threadCount);
+#ifdef JPEG_ENCODER_PROFILE
+static __thread JpegEncoder_Profile JpegEncoder_threadProfile;  // このスレッドでまだまとめていない計測値
+static uint64_t JpegEncoder_readTimer(void);
+static void JpegEncoder_addStageTime(int stage, uint64_t start);
+static void JpegEncoder_mergeProfile(JpegEncoder_Profile* profile);
+static void JpegEncoder_dumpProfile(const JpegEncoder* encoder);
+#endif
+static inline void JpegEncoder_put_bits(JpegEncoder_BitWriter* writer, uint32_t value, int length, JpegEncoder_Sink* sink);
+static void* JpegEncoder_encodeWorker(void* arg);
+static int JpegEncoder_encodeParallel(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink);
+static int JpegEncoder_prepareScan(JpegEncoder* encoder, int width, int height);
+static int JpegEncoder_writeAll(int fd, const unsigned char* data, size_t size);
+static int JpegEncoder_readAll(int fd, unsigned char* data, size_t size);
+static void JpegEncoder_convertColorSpace_422(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static void JpegEncoder_convertColorSpace_444(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static void JpegEncoder_convertColorSpace_gray(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos);
+static int JpegEncoder_checkFrame(const JpegEncoder_Frame* frame);
+static inline void JpegEncoder_readFrameMCU(const JpegEncoder_Frame* frame, char (*blocks)[64], int xPos, int yPos, int H, int V, int chroma);
+static inline void JpegEncoder_copySigned8(const unsigned char* src, char* dst);
+static unsigned char* JpegEncoder_mapFile(const char* fileName, size_t* fileSize, int* mapped);
+static void JpegEncoder_validateMCUCache(JpegEncoder* encoder, int format);
+static void JpegEncoder_clearMCUCache(JpegEncoder_MCUCache* cache);
+static int JpegEncoder_gatherMCU(const JpegEncoder* encoder, int mcu, unsigned char* key);
+static uint64_t JpegEncoder_hashMCU(const unsigned char* key, int keySize);
+static int JpegEncoder_lookupMCU(JpegEncoder_MCUCache* cache, uint64_t hash, const unsigned char* key, int keySize, short (*coef)[64], uint64_t* mask, int blockCount);
+static void JpegEncoder_storeMCU(JpegEncoder_MCUCache* cache, uint64_t hash, const unsigned char* key, int keySize, short (*coef)[64], const uint64_t* mask, int blockCount);
+static void JpegEncoder_unlinkMCU(JpegEncoder_MCUCache* cache, int index);
+
+// サブサンプリングごとのMCU処理（JPEG_DEFINE_MCUで生成する）
+#define JPEG_DECLARE_MCU(suffix) \
+    static void JpegEncoder_convertMCU_##suffix(const JpegEncoder* encoder, int mcu, char (*blocks)[64]); \
+    static inline void JpegEncoder_transformMCU_##suffix(JpegEncoder* encoder, int mcu, short (*coef)[64], uint64_t* mask); \
+    static inline void JpegEncoder_huffmanMCU_##suffix(JpegEncoder* encoder, JpegEncoder_ScanState* state, short (*coef)[64], const uint64_t* mask, JpegEncoder_Sink* sink); \
+    static void JpegEncoder_encodeMCUs_##suffix(JpegEncoder* encoder, JpegEncoder_ScanState* state, int firstMCU, int lastMCU, JpegEncoder_Sink* sink);
+
+JPEG_DECLARE_MCU(420)
+JPEG_DECLARE_MCU(422)
+JPEG_DECLARE_MCU(444)
+JPEG_DECLARE_MCU(gray)
+
+// H, V: MCU内のYブロックの横と縦の数、CHROMA: 1ならCb/Crブロックを持つ
+#define JPEG_LAYOUT(suffix, name, H, V, CHROMA) \
+    { name, (H) * 8, (V) * 8, (H) * (V), (H) * (V) + 2 * (CHROMA), (CHROMA) ? 3 : 1, (unsigned char)(((H) << 4) | (V)), \
+      JpegEncoder_convertMCU_##suffix, JpegEncoder_transformMCU_##suffix, JpegEncoder_huffmanMCU_##suffix, JpegEncoder_encodeMCUs_##suffix }
+
+// JPEG_SUBSAMPLING_xxxの順
+static const JpegEncoder_Layout JpegEncoder_layouts[] = {
+    JPEG_LAYOUT(420, "4:2:0", 2, 2, 1),
+    JPEG_LAYOUT(422, "4:2:2", 2, 1, 1),
+    JPEG_LAYOUT(444, "4:4:4", 1, 1, 1),
+    JPEG_LAYOUT(gray, "gray", 1, 1, 0)
+};
+
+// 画素形式ごとの先頭のプレーンの1画素のバイト数（JpegEncoder_PixelFormatの順）
+static const int JpegEncoder_pixelBytes[] = { 3, 4, 4, 1, 1, 2 };
+
+// BMPファイルヘッダ構造体
+#pragma pack(push, 2)
+typedef struct {
+    unsigned short bfType;
+    unsigned int bfSize;
+    unsigned short bfReserved1;
+    unsigned short bfReserved2;
+    unsigned int bfOffBits;
+} BITMAPFILEHEADER;
+
+typedef struct {
+    unsigned int biSize;
+    int biWidth;
+    int biHeight;
+    unsigned short biPlanes;
+    unsigned short biBitCount;
+    unsigned int biCompression;
+    unsigned int biSizeImage;
+    int biXPelsPerMeter;
+    int biYPelsPerMeter;
+    unsigned int biClrUsed;
+    unsigned int biClrImportant;
+} BITMAPINFOHEADER;
+#pragma pack(pop)
+
+// BMPファイルの読み込み
+// ファイルをメモリにマップし、画素データをコピーせずに参照する
+// 下から上に格納されたBMPは、一番上の行を指すポインタと負のstrideで表す
+int JpegEncoder_readFromBMP(JpegEncoder_Image* image, const char* fileName) {
+    size_t fileSize;
+    int mapped;
+    unsigned char* base = JpegEncoder_mapFile(fileName, &fileSize, &mapped);
+    if (!base) return 0;
+    if (fileSize < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) {
+        if (mapped) munmap(base, fileSize);
+        else free(base);
+        return 0;
+    }
+
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    memcpy(&fileHeader, base, sizeof(fileHeader));
+    memcpy(&infoHeader, base + sizeof(fileHeader), sizeof(infoHeader));
+
+    // 高さの符号を反転する前に、ファイルの値がJPEGで表せる範囲にあることを確かめる（INT_MINの反転は未定義動作）
+    if (infoHeader.biWidth > JPEG_MAX_DIMENSION || infoHeader.biHeight > JPEG_MAX_DIMENSION || infoHeader.biHeight < -JPEG_MAX_DIMENSION) {
+        fprintf(stderr, "Error: BMP size %dx%d is out of range\n", infoHeader.biWidth, infoHeader.biHeight);
+        if (mapped) munmap(base, fileSize);
+        else free(base);
+        return 0;
+    }
+
+    int width = infoHeader.biWidth;
+    int height = infoHeader.biHeight < 0 ? (-infoHeader.biHeight) : infoHeader.biHeight;
+    size_t rowSize = ((size_t)width * 3 + 3) & ~(size_t)3;
+
+    if (fileHeader.bfType != 0x4D42 ||
+        infoHeader.biBitCount != 24 || infoHeader.biCompression != 0 ||
+        width <= 0 || (width & 15) != 0 || (height & 15) != 0 ||
+        fileHeader.bfOffBits > fileSize || (fileSize - fileHeader.bfOffBits) / rowSize < (size_t)height) {
+        if (mapped) munmap(base, fileSize);
+        else free(base);
+        return 0;
+    }
+
+    unsigned char* pixels = base + fileHeader.bfOffBits;
+    if (mapped) madvise(base, fileSize, MADV_WILLNEED);
+
+    if (infoHeader.biHeight > 0) {
+        image->data = pixels + (height - 1) * rowSize;
+        image->stride = -(int)rowSize;
+    } else {
+        image->data = pixels;
+        image->stride = (int)rowSize;
+    }
+    image->width = width;
+    image->height = height;
+    image->base = base;
+    image->baseSize = fileSize;
+    image->mapped = mapped;
+    return 1;
+}
+
+// ファイル全体をメモリにマップする（マップできないファイルは一括で読み込む）
+// 空のファイルや読み込めないファイルではNULLを返す
+static unsigned char* JpegEncoder_mapFile(const char* fileName, size_t* fileSize, int* mapped) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s\n", fileName);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    *fileSize = (size_t)st.st_size;
+    *mapped = 1;
+    unsigned char* base = (unsigned char*)mmap(NULL, *fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        *mapped = 0;
+        base = (unsigned char*)malloc(*fileSize);
+        if (!base || !JpegEncoder_readAll(fd, base, *fileSize)) {
+            free(base);
+            close(fd);
+            return NULL;
+        }
+    }
+    close(fd);
+    return base;
+}
+
+// ヘッダのない生のフレームファイルの読み込み
+// プレーンは行間を詰めて、I420はY、U、V、NV12はY、UVの順に並んでいること
+int JpegEncoder_readRawFrame(JpegEncoder_Image* image, JpegEncoder_Frame* frame, const char* fileName, int format, int width, int height) {
+    if (format < JPEG_PIXEL_BGR || format > JPEG_PIXEL_YUYV) {
+        fprintf(stderr, "Error: Unknown pixel format\n");
+        return 0;
+    }
+    if (width <= 0 || height <= 0 || (width & 15) != 0 || (height & 15) != 0) {
+        fprintf(stderr, "Error: Frame size must be a multiple of 16 (%dx%d)\n", width, height);
+        return 0;
+    }
+
+    size_t lumaSize = (size_t)width * JpegEncoder_pixelBytes[format] * height;
+    size_t chromaSize = format == JPEG_PIXEL_I420 ? (size_t)(width / 2) * (height / 2) :
+                        format == JPEG_PIXEL_NV12 ? (size_t)width * (height / 2) : 0;
+
+    size_t fileSize;
+    int mapped;
+    unsigned char* base = JpegEncoder_mapFile(fileName, &fileSize, &mapped);
+    if (!base) return 0;
+    size_t frameSize = lumaSize + chromaSize * (format == JPEG_PIXEL_I420 ? 2 : 1);
+    if (fileSize < frameSize) {
+        fprintf(stderr, "Error: Raw frame file %s is too small for %dx%d\n", fileName, width, height);
+        if (mapped) munmap(base, fileSize);
+        else free(base);
+        return 0;
+    }
+    if (mapped) madvise(base, fileSize, MADV_WILLNEED);
+
+    memset(frame, 0, sizeof(*frame));
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    frame->planes[0] = base;
+    frame->strides[0] = width * JpegEncoder_pixelBytes[format];
+    if (format == JPEG_PIXEL_I420) {
+        frame->planes[1] = base + lumaSize;
+        frame->planes[2] = base + lumaSize + chromaSize;
+        frame->strides[1] = width / 2;
+        frame->strides[2] = width / 2;
+    } else if (format == JPEG_PIXEL_NV12) {
+        frame->planes[1] = base + lumaSize;
+        frame->strides[1] = width;
+    }
+
+    image->data = base;
+    image->width = width;
+    image->height = height;
+    image->stride = frame->strides[0];
+    image->base = base;
+    image->baseSize = fileSize;
+    image->mapped = mapped;
+    return 1;
+}
+
+// 全バイトの読み込み
+static int JpegEncoder_readAll(int fd, unsigned char* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, data + done, size - done);
+        if (n <= 0) return 0;
+        done += (size_t)n;
+    }
+    return 1;
+}
+
+// BMPファイルをストリップ単位で読み込むために開く
+int JpegEncoder_openBMPStream(JpegEncoder_BMPStream* stream, const char* fileName) {
+    FILE* fp = fopen(fileName, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open file %s\n", fileName);
+        return 0;
+    }
+
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, fp) != 1 || fileHeader.bfType != 0x4D42 ||
+        fread(&infoHeader, sizeof(infoHeader), 1, fp) != 1 ||
+        infoHeader.biBitCount != 24 || infoHeader.biCompression != 0) {
+        fclose(fp);
+        return 0;
+    }
+    if (infoHeader.biWidth <= 0 || infoHeader.biWidth > JPEG_MAX_DIMENSION ||
+        infoHeader.biHeight > JPEG_MAX_DIMENSION || infoHeader.biHeight < -JPEG_MAX_DIMENSION) {
+        fprintf(stderr, "Error: BMP size %dx%d is out of range\n", infoHeader.biWidth, infoHeader.biHeight);
+        fclose(fp);
+        return 0;
+    }
+
+    stream->fp = fp;
+    stream->width = infoHeader.biWidth;
+    stream->height = infoHeader.biHeight < 0 ? (-infoHeader.biHeight) : infoHeader.biHeight;
+    stream->topDown = infoHeader.biHeight < 0;
+    stream->dataOffset = fileHeader.bfOffBits;
+    stream->rowSize = (stream->width * 3 + 3) & ~3;
+    return 1;
+}
+
+// 画像上のyPos行目からlines行をstripに読み込む（上から下の順、行間はwidth*3バイト）
+int JpegEncoder_readBMPStrip(JpegEncoder_BMPStream* stream, int yPos, int lines, unsigned char* strip) {
+    size_t lineSize = (size_t)stream->width * 3;
+    for (int i = 0; i < lines; i++) {
+        int row = yPos + i;
+        long fileRow = stream->topDown ? row : stream->height - 1 - row;
+        if (fseek(stream->fp, stream->dataOffset + fileRow * (long)stream->rowSize, SEEK_SET) != 0 ||
+            fread(strip + i * lineSize, 1, lineSize, stream->fp) != lineSize) {
+            fprintf(stderr, "Error: Cannot read line %d\n", row);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// BMPファイルを閉じる
+void JpegEncoder_closeBMPStream(JpegEncoder_BMPStream* stream) {
+    if (stream->fp) fclose(stream->fp);
+    stream->fp = NULL;
+}
+
+// 入力画像の解放
+void JpegEncoder_freeImage(JpegEncoder_Image* image) {
+    if (image->mapped) munmap(image->base, image->baseSize);
+    else free(image->base);
+    image->data = NULL;
+    image->width = 0;
+    image->height = 0;
+    image->stride = 0;
+    image->base = NULL;
+    image->baseSize = 0;
+    image->mapped = 0;
+}
+
+// エンコーダの生成
+JpegEncoder* JpegEncoder_create(void) {
+    static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+    pthread_once(&kernelsOnce, JpegEncoder_initDefaultKernels);
+
+    JpegEncoder* encoder = (JpegEncoder*)calloc(1, sizeof(JpegEncoder));
+    if (!encoder) {
+        fprintf(stderr, "Error: Cannot allocate encoder\n");
+        return NULL;
+    }
+
+    JpegEncoder_setQuality(encoder, JPEG_DEFAULT_QUALITY);
+    JpegEncoder_setStandardHuffmanSpecs(encoder);
+    JpegEncoder_initHuffmanTables(encoder);
+    encoder->dctMethod = JPEG_DCT_FAST;
+    encoder->flatThreshold = 0;
+    encoder->parallelMode = JPEG_PARALLEL_SEGMENTS;
+    encoder->subsampling = JPEG_SUBSAMPLING_420;
+    encoder->layout = &JpegEncoder_layouts[JPEG_SUBSAMPLING_420];
+    encoder->restartInterval = 0;
+    encoder->threadCount = 1;
+    return encoder;
+}
+
+// エンコーダの破棄
+void JpegEncoder_destroy(JpegEncoder* encoder) {
+    if (!encoder) return;
+    free(encoder->coefCache);
+    free(encoder->maskCache);
+    JpegEncoder_setMCUCache(encoder, 0);
+    free(encoder);
+}
+
+// 品質の設定（1～100、IJGと同じ尺度）
+int JpegEncoder_setQuality(JpegEncoder* encoder, int quality) {
+    if (quality < 1 || quality > 100) {
+        fprintf(stderr, "Error: Quality must be between 1 and 100\n");
+        return 0;
+    }
+    encoder->quality = quality;
+    encoder->quantTables = JpegEncoder_getQuantTables(quality);
+    return 1;
+}
+
+// 品質ごとの量子化テーブルの取得
+// 初めて使う品質のときだけテーブルと逆数を計算し、以降はすべてのエンコーダで共有する
+static const JpegEncoder_QuantTables* JpegEncoder_getQuantTables(int quality) {
+    static JpegEncoder_QuantTables tables[101];
+    static int ready[101];
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    if (!__atomic_load_n(&ready[quality], __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mutex);
+        if (!ready[quality]) {
+            JpegEncoder_initQualityTables(&tables[quality], quality);
+            __atomic_store_n(&ready[quality], 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return &tables[quality];
+}
+
+// 品質に合わせた量子化テーブルの計算
+// 品質50で標準テーブルそのもの、それより上は線形に、下は反比例で値を変える
+static void JpegEncoder_initQualityTables(JpegEncoder_QuantTables* tables, int quality) {
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; i++) {
+        int temp = (Luminance_Quantization_Table[i] * scale + 50) / 100;
+        if (temp <= 0) temp = 1;
+        if (temp > 0xFF) temp = 0xFF;
+        tables->YTable[ZigZag[i]] = (unsigned char)temp;
+
+        temp = (Chrominance_Quantization_Table[i] * scale + 50) / 100;
+        if (temp <= 0) temp = 1;
+        if (temp > 0xFF) temp = 0xFF;
+        tables->CbCrTable[ZigZag[i]] = (unsigned char)temp;
+    }
+
+    JpegEncoder_initQuantRecip(tables->YTable, tables->YRecip);
+    JpegEncoder_initQuantRecip(tables->CbCrTable, tables->CbCrRecip);
+}
+
+// DCT方式の設定
+void JpegEncoder_setDCTMethod(JpegEncoder* encoder, int dctMethod) {
+    encoder->dctMethod = dctMethod;
+}
+
+// 平坦ブロックの判定幅の設定
+int JpegEncoder_setFlatBlockThreshold(JpegEncoder* encoder, int threshold) {
+    if (threshold < JPEG_FLAT_BLOCKS_OFF || threshold > 255) {
+        fprintf(stderr, "Error: Flat block threshold must be between -1 and 255\n");
+        return 0;
+    }
+    encoder->flatThreshold = threshold;
+    return 1;
+}
+
+// 並列化の方法の設定
+void JpegEncoder_setParallelMode(JpegEncoder* encoder, int parallelMode) {
+    encoder->parallelMode = parallelMode;
+}
+
+// クロマサブサンプリングの設定
+int JpegEncoder_setSubsampling(JpegEncoder* encoder, int subsampling) {
+    if (subsampling < JPEG_SUBSAMPLING_420 || subsampling > JPEG_SUBSAMPLING_GRAY) {
+        fprintf(stderr, "Error: Unknown subsampling %d\n", subsampling);
+        return 0;
+    }
+    encoder->subsampling = subsampling;
+    encoder->layout = &JpegEncoder_layouts[subsampling];
+    return 1;
+}
+
+// リスタートインターバルの設定（MCU数、0で無効）
+int JpegEncoder_setRestartInterval(JpegEncoder* encoder, int restartInterval) {
+    if ((restartInterval < 0 && restartInterval != JPEG_RESTART_MCU_ROW) || restartInterval > 0xFFFF) {
+        fprintf(stderr, "Error: Restart interval must be between 0 and 65535\n");
+        return 0;
+    }
+    encoder->restartInterval = restartInterval;
+    return 1;
+}
+
+// スレッド数の設定
+// リスタートインターバルが有効な場合は、インターバルごとにthreadCount個のスレッドで並列にエンコードする
+// 無効な場合でもthreadCountが2以上なら、parallelModeの方法で並列にエンコードする
+int JpegEncoder_setThreadCount(JpegEncoder* encoder, int threadCount) {
+    if (threadCount < 1) {
+        fprintf(stderr, "Error: Thread count must be at least 1\n");
+        return 0;
+    }
+    encoder->threadCount = threadCount;
+    return 1;
+}
+
+// エンコード済みMCUのキャッシュの設定（entriesは保持するMCU数、0で無効）
+// 設定し直すと保持していた係数とヒット数などの集計は捨てられる
+int JpegEncoder_setMCUCache(JpegEncoder* encoder, int entries) {
+    if (entries < 0) {
+        fprintf(stderr, "Error: MCU cache size must not be negative\n");
+        return 0;
+    }
+
+    JpegEncoder_MCUCache* cache = encoder->mcuCache;
+    if (cache) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+        encoder->mcuCache = NULL;
+    }
+    if (entries == 0) return 1;
+
+    int bucketCount = 1;
+    while (bucketCount < entries && bucketCount < (1 << 30)) bucketCount <<= 1;
+
+    cache = (JpegEncoder_MCUCache*)calloc(1, sizeof(JpegEncoder_MCUCache));
+    if (cache) {
+        cache->entries = (JpegEncoder_MCUCacheEntry*)malloc(sizeof(JpegEncoder_MCUCacheEntry) * (size_t)entries);
+        cache->buckets = (int*)malloc(sizeof(int) * (size_t)bucketCount);
+    }
+    if (!cache || !cache->entries || !cache->buckets) {
+        fprintf(stderr, "Error: Cannot allocate MCU cache of %d entries\n", entries);
+        if (cache) {
+            free(cache->entries);
+            free(cache->buckets);
+            free(cache);
+        }
+        return 0;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->capacity = entries;
+    cache->bucketMask = bucketCount - 1;
+    cache->quantTables = NULL;  // 最初のエンコードで設定する
+    JpegEncoder_clearMCUCache(cache);
+    encoder->mcuCache = cache;
+    return 1;
+}
+
+// エンコード済みMCUのキャッシュの集計（キャッシュを設定してからの累計）
+void JpegEncoder_getMCUCacheStats(const JpegEncoder* encoder, JpegEncoder_MCUCacheStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    JpegEncoder_MCUCache* cache = encoder->mcuCache;
+    if (!cache) return;
+
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    stats->entries = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// キャッシュの全項目を捨てる（集計は残す）
+static void JpegEncoder_clearMCUCache(JpegEncoder_MCUCache* cache) {
+    memset(cache->buckets, 0xFF, sizeof(int) * ((size_t)cache->bucketMask + 1));
+    cache->count = 0;
+    cache->lruHead = -1;
+    cache->lruTail = -1;
+}
+
+// エンコードの開始時に、保持している係数がいまの設定で作ったものかを確認する
+// 量子化テーブル、サブサンプリング、DCT方式、平坦ブロックの判定幅、画素形式のどれかが変わっていたら全項目を捨てる
+static void JpegEncoder_validateMCUCache(JpegEncoder* encoder, int format) {
+    JpegEncoder_MCUCache* cache = encoder->mcuCache;
+    if (!cache) return;
+
+    if (cache->quantTables != encoder->quantTables || cache->subsampling != encoder->subsampling ||
+        cache->dctMethod != encoder->dctMethod || cache->flatThreshold != encoder->flatThreshold || cache->format != format) {
+        JpegEncoder_clearMCUCache(cache);
+        cache->quantTables = encoder->quantTables;
+        cache->subsampling = encoder->subsampling;
+        cache->dctMethod = encoder->dctMethod;
+        cache->flatThreshold = encoder->flatThreshold;
+        cache->format = format;
+    }
+}
+
+// MCUの入力画素をキーとして集める（返り値はキーのバイト数）
+// 各プレーンのうちMCUの変換で読む範囲を行ごとに詰めて並べ、32バイト単位まで0で埋める
+static int JpegEncoder_gatherMCU(const JpegEncoder* encoder, int mcu, unsigned char* key) {
+    const JpegEncoder_Frame* frame = &encoder->frame;
+    const JpegEncoder_Layout* layout = encoder->layout;
+    int mcuColumns = encoder->width / layout->mcuWidth;
+    int xPos = (mcu % mcuColumns) * layout->mcuWidth;
+    int yPos = (mcu / mcuColumns) * layout->mcuHeight - encoder->frameRow;
+
+    // 先頭のプレーン、I420のU/V、NV12のUVの順（グレースケールではU/Vを読まない）
+    int planeCount = layout->components == 1 ? 1 : frame->format == JPEG_PIXEL_I420 ? 3 : frame->format == JPEG_PIXEL_NV12 ? 2 : 1;
+    int size = 0;
+    for (int plane = 0; plane < planeCount; plane++) {
+        int rowBytes = plane == 0 ? layout->mcuWidth * JpegEncoder_pixelBytes[frame->format] :
+                       frame->format == JPEG_PIXEL_I420 ? layout->mcuWidth / 2 : layout->mcuWidth;
+        int rows = plane == 0 ? layout->mcuHeight : layout->mcuHeight / 2;
+        int top = plane == 0 ? yPos : yPos / 2;
+        int left = plane == 0 ? xPos * JpegEncoder_pixelBytes[frame->format] : frame->format == JPEG_PIXEL_I420 ? xPos / 2 : xPos;
+        for (int row = 0; row < rows; row++) {
+            memcpy(key + size, frame->planes[plane] + (ptrdiff_t)(top + row) * frame->strides[plane] + left, rowBytes);
+            size += rowBytes;
+        }
+    }
+    while (size & 31) key[size++] = 0;
+    return size;
+}
+
+// キーのハッシュ値（8バイトずつ4系列で乗算と混合を行い、最後にまとめる）
+static uint64_t JpegEncoder_hashMCU(const unsigned char* key, int keySize) {
+    const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+    uint64_t lane[4] = { (uint64_t)keySize, prime, prime << 1, prime >> 1 };
+    for (int i = 0; i < keySize; i += 32) {
+        for (int j = 0; j < 4; j++) {
+            uint64_t word;
+            memcpy(&word, key + i + j * 8, 8);
+            lane[j] = (lane[j] ^ word) * prime;
+            lane[j] ^= lane[j] >> 29;
+        }
+    }
+    uint64_t hash = lane[0] ^ (lane[1] * prime) ^ ((lane[2] << 21) | (lane[2] >> 43)) ^ ((lane[3] << 42) | (lane[3] >> 22));
+    return (hash ^ (hash >> 32)) * prime;
+}
+
+// キャッシュの検索（見つかればcoefとmaskに写して1を返し、LRUリストの先頭に移す）
+static int JpegEncoder_lookupMCU(JpegEncoder_MCUCache* cache, uint64_t hash, const unsigned char* key, int keySize, short (*coef)[64], uint64_t* mask, int blockCount) {
+    pthread_mutex_lock(&cache->lock);
+    for (int index = cache->buckets[hash & cache->bucketMask]; index >= 0; index = cache->entries[index].hashNext) {
+        JpegEncoder_MCUCacheEntry* entry = &cache->entries[index];
+        if (entry->hash != hash || entry->keySize != keySize || memcmp(entry->key, key, keySize) != 0) continue;
+
+        memcpy(coef, entry->coef, sizeof(entry->coef[0]) * blockCount);
+        memcpy(mask, entry->mask, sizeof(entry->mask[0]) * blockCount);
+        if (cache->lruHead != index) {
+            JpegEncoder_unlinkMCU(cache, index);
+            entry->lruPrev = -1;
+            entry->lruNext = cache->lruHead;
+            cache->entries[cache->lruHead].lruPrev = index;
+            cache->lruHead = index;
+        }
+        cache->stats.hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return 1;
+    }
+    cache->stats.misses++;
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+
+// LRUリストから項目を外す
+static void JpegEncoder_unlinkMCU(JpegEncoder_MCUCache* cache, int index) {
+    JpegEncoder_MCUCacheEntry* entry = &cache->entries[index];
+    if (entry->lruPrev >= 0) cache->entries[entry->lruPrev].lruNext = entry->lruNext;
+    else cache->lruHead = entry->lruNext;
+    if (entry->lruNext >= 0) cache->entries[entry->lruNext].lruPrev = entry->lruPrev;
+    else cache->lruTail = entry->lruPrev;
+}
+
+// キャッシュへの追加（満杯なら最も長く使われていない項目を置き換える）
+static void JpegEncoder_storeMCU(JpegEncoder_MCUCache* cache, uint64_t hash, const unsigned char* key, int keySize, short (*coef)[64], const uint64_t* mask, int blockCount) {
+    pthread_mutex_lock(&cache->lock);
+
+    // 検索してから追加するまでの間に、他のスレッドが同じMCUを追加していることがある
+    int* bucket = &cache->buckets[hash & cache->bucketMask];
+    for (int index = *bucket; index >= 0; index = cache->entries[index].hashNext) {
+        const JpegEncoder_MCUCacheEntry* entry = &cache->entries[index];
+        if (entry->hash == hash && entry->keySize == keySize && memcmp(entry->key, key, keySize) == 0) {
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+    }
+
+    int index;
+    if (cache->count < cache->capacity) {
+        index = cache->count++;
+    } else {
+        index = cache->lruTail;
+        JpegEncoder_unlinkMCU(cache, index);
+        int* link = &cache->buckets[cache->entries[index].hash & cache->bucketMask];
+        while (*link != index) link = &cache->entries[*link].hashNext;
+        *link = cache->entries[index].hashNext;
+        cache->stats.evictions++;
+    }
+
+    JpegEncoder_MCUCacheEntry* entry = &cache->entries[index];
+    entry->hash = hash;
+    entry->keySize = keySize;
+    memcpy(entry->key, key, keySize);
+    memcpy(entry->coef, coef, sizeof(entry->coef[0]) * blockCount);
+    memcpy(entry->mask, mask, sizeof(entry->mask[0]) * blockCount);
+    entry->hashNext = *bucket;
+    *bucket = index;
+    entry->lruPrev = -1;
+    entry->lruNext = cache->lruHead;
+    if (cache->lruHead >= 0) cache->entries[cache->lruHead].lruPrev = index;
+    cache->lruHead = index;
+    if (cache->lruTail < 0) cache->lruTail = index;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// ハフマンテーブルの初期化（huffmanSpecsから符号を生成する）
+static void JpegEncoder_initHuffmanTables(JpegEncoder* encoder) {
+    const JpegEncoder_HuffmanSpec* specs = encoder->huffmanSpecs;
+
+    memset(encoder->Y_DC_Huffman_Table, 0, sizeof(encoder->Y_DC_Huffman_Table));
+    JpegEncoder_computeHuffmanTable(specs[JPEG_HUFFMAN_Y_DC].bits, specs[JPEG_HUFFMAN_Y_DC].values, encoder->Y_DC_Huffman_Table);
+
+    memset(encoder->Y_AC_Huffman_Table, 0, sizeof(encoder->Y_AC_Huffman_Table));
+    JpegEncoder_computeHuffmanTable(specs[JPEG_HUFFMAN_Y_AC].bits, specs[JPEG_HUFFMAN_Y_AC].values, encoder->Y_AC_Huffman_Table);
+
+    memset(encoder->CbCr_DC_Huffman_Table, 0, sizeof(encoder->CbCr_DC_Huffman_Table));
+    JpegEncoder_computeHuffmanTable(specs[JPEG_HUFFMAN_CBCR_DC].bits, specs[JPEG_HUFFMAN_CBCR_DC].values, encoder->CbCr_DC_Huffman_Table);
+
+    memset(encoder->CbCr_AC_Huffman_Table, 0, sizeof(encoder->CbCr_AC_Huffman_Table));
+    JpegEncoder_computeHuffmanTable(specs[JPEG_HUFFMAN_CBCR_AC].bits, specs[JPEG_HUFFMAN_CBCR_AC].values, encoder->CbCr_AC_Huffman_Table);
+
+    JpegEncoder_initCodeTable(encoder->Y_DC_Huffman_Table, encoder->Y_AC_Huffman_Table, encoder->Y_DC_Codes, encoder->Y_AC_Codes);
+    JpegEncoder_initCodeTable(encoder->CbCr_DC_Huffman_Table, encoder->CbCr_AC_Huffman_Table, encoder->CbCr_DC_Codes, encoder->CbCr_AC_Codes);
+}
+
+// Annex Kの標準ハフマンテーブルを設定
+static void JpegEncoder_setStandardHuffmanSpecs(JpegEncoder* encoder) {
+    JpegEncoder_setHuffmanSpec(&encoder->huffmanSpecs[JPEG_HUFFMAN_Y_DC], Standard_DC_Luminance_NRCodes, Standard_DC_Luminance_Values);
+    JpegEncoder_setHuffmanSpec(&encoder->huffmanSpecs[JPEG_HUFFMAN_Y_AC], Standard_AC_Luminance_NRCodes, Standard_AC_Luminance_Values);
+    JpegEncoder_setHuffmanSpec(&encoder->huffmanSpecs[JPEG_HUFFMAN_CBCR_DC], Standard_DC_Chrominance_NRCodes, Standard_DC_Chrominance_Values);
+    JpegEncoder_setHuffmanSpec(&encoder->huffmanSpecs[JPEG_HUFFMAN_CBCR_AC], Standard_AC_Chrominance_NRCodes, Standard_AC_Chrominance_Values);
+    encoder->standardHuffman = 1;
+}
+
+// ハフマンテーブルの定義の設定
+static void JpegEncoder_setHuffmanSpec(JpegEncoder_HuffmanSpec* spec, const unsigned char* bits, const unsigned char* values) {
+    int count = 0;
+    for (int i = 0; i < 16; i++) count += bits[i];
+
+    memcpy(spec->bits, bits, 16);
+    memcpy(spec->values, values, count);
+    spec->count = count;
+}
+
+// ハフマンテーブル最適化の設定
+void JpegEncoder_setOptimizeHuffman(JpegEncoder* encoder, int optimize) {
+    encoder->optimizeHuffman = optimize;
+}
+
+// 符号表の生成
+// 係数ごとにハフマン符号と付加ビットをまとめ、1回の書き込みで済むようにする
+// AC係数0の位置には、連続長0ならEOB、連続長15ならZRLが入る
+static void JpegEncoder_initCodeTable(const BitString* HTDC, const BitString* HTAC, uint32_t* DCCodes, uint32_t* ACCodes) {
+    for (int value = -2047; value <= 2047; value++) {
+        BitString bs = JpegEncoder_getBitCode(value);
+        BitString code = HTDC[bs.length];
+        DCCodes[value & 0xFFF] = ((((uint32_t)code.value << bs.length) | (uint32_t)bs.value) << 5) | (uint32_t)(code.length + bs.length);
+    }
+
+    for (int run = 0; run < 16; run++) {
+        for (int value = -1023; value <= 1023; value++) {
+            BitString bs = JpegEncoder_getBitCode(value);
+            BitString code = HTAC[(run << 4) | bs.length];
+            ACCodes[(run << 11) | (value & 0x7FF)] = ((((uint32_t)code.value << bs.length) | (uint32_t)bs.value) << 5) | (uint32_t)(code.length + bs.length);
+        }
+    }
+}
+
+// 出力先の内容をファイルに書き出す（1回のwrite）
+int JpegEncoder_writeSink(const JpegEncoder_Sink* sink, const char* fileName) {
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open output file %s\n", fileName);
+        return 0;
+    }
+
+    int success = JpegEncoder_writeAll(fd, sink->data, sink->size);
+    close(fd);
+
+    if (!success) {
+        fprintf(stderr, "Error: Cannot write output file %s\n", fileName);
+        return 0;
+    }
+    return 1;
+}
+
+// 出力先の内容をファイルディスクリプタに書き出して空にする
+// ストリーミングエンコードでストリップごとに呼び出せば、出力先の大きさは一定に保たれる
+int JpegEncoder_drainSink(JpegEncoder_Sink* sink, int fd) {
+    if (!JpegEncoder_writeAll(fd, sink->data, sink->size)) {
+        fprintf(stderr, "Error: Cannot write encoded data\n");
+        return 0;
+    }
+    sink->size = 0;
+    return 1;
+}
+
+// 全バイトの書き出し
+static int JpegEncoder_writeAll(int fd, const unsigned char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n <= 0) return 0;
+        written += (size_t)n;
+    }
+    return 1;
+}
+
+// 画像サイズの確認とリスタートインターバルの決定
+static int JpegEncoder_prepareScan(JpegEncoder* encoder, int width, int height) {
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Error: No image data to encode\n");
+        return 0;
+    }
+    if ((width & 15) != 0 || (height & 15) != 0) {
+        fprintf(stderr, "Error: Image size must be a multiple of 16\n");
+        return 0;
+    }
+    if (width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+        fprintf(stderr, "Error: Image size must be at most %d\n", JPEG_MAX_DIMENSION);
+        return 0;
+    }
+
+    encoder->restartMCUs = encoder->restartInterval == JPEG_RESTART_MCU_ROW ? width / encoder->layout->mcuWidth : encoder->restartInterval;
+    if (encoder->restartMCUs > 0xFFFF) {
+        fprintf(stderr, "Error: Image is too wide for one restart interval per MCU row\n");
+        return 0;
+    }
+    return 1;
+}
+
+// JPEGエンコーディング
+// 拡張可能な出力先の場合、sink->dataの所有権は呼び出し側に渡る
+int JpegEncoder_encode(JpegEncoder* encoder, const unsigned char* rgbBuffer, int width, int height, int stride, JpegEncoder_Sink* sink) {
+    JpegEncoder_Frame frame;
+    JpegEncoder_bgrFrame(&frame, rgbBuffer, width, height, stride);
+    return JpegEncoder_encodeFrame(encoder, &frame, sink);
+}
+
+// 任意の画素形式のフレームのエンコード
+int JpegEncoder_encodeFrame(JpegEncoder* encoder, const JpegEncoder_Frame* frame, JpegEncoder_Sink* sink) {
+    if (!JpegEncoder_checkFrame(frame)) return 0;
+    if (!JpegEncoder_prepareScan(encoder, frame->width, frame->height)) return 0;
+
+    encoder->frame = *frame;
+    encoder->frameRow = 0;
+    encoder->width = frame->width;
+    encoder->height = frame->height;
+    JpegEncoder_validateMCUCache(encoder, frame->format);
+    JPEG_PROFILE_RESET(encoder);
+
+    int success = JpegEncoder_encodeScan(encoder, sink);
+    encoder->frame.planes[0] = NULL;
+    return success;
+}
+
+// BGRの画像を指すフレーム
+void JpegEncoder_bgrFrame(JpegEncoder_Frame* frame, const unsigned char* rgbBuffer, int width, int height, int stride) {
+    memset(frame, 0, sizeof(*frame));
+    frame->format = JPEG_PIXEL_BGR;
+    frame->width = width;
+    frame->height = height;
+    frame->planes[0] = rgbBuffer;
+    frame->strides[0] = stride;
+}
+
+// フレームの画素形式と、形式に必要なプレーンがそろっているかの確認
+static int JpegEncoder_checkFrame(const JpegEncoder_Frame* frame) {
+    if (!frame || frame->format < JPEG_PIXEL_BGR || frame->format > JPEG_PIXEL_YUYV) {
+        fprintf(stderr, "Error: Unknown pixel format\n");
+        return 0;
+    }
+    int planeCount = frame->format == JPEG_PIXEL_I420 ? 3 : frame->format == JPEG_PIXEL_NV12 ? 2 : 1;
+    for (int i = 0; i < planeCount; i++) {
+        if (!frame->planes[i]) {
+            fprintf(stderr, "Error: No image data to encode\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 保存済みのDCT係数からのエンコード
+// 現在の品質で量子化し直すので、色空間変換とDCTは行わない
+int JpegEncoder_encodeCoefficients(JpegEncoder* encoder, const JpegEncoder_Coefficients* coefficients, JpegEncoder_Sink* sink) {
+    if (!coefficients) {
+        fprintf(stderr, "Error: No coefficients to encode\n");
+        return 0;
+    }
+    if (coefficients->subsampling != encoder->subsampling) {
+        fprintf(stderr, "Error: Coefficients were analyzed with %s subsampling\n", JpegEncoder_layouts[coefficients->subsampling].name);
+        return 0;
+    }
+    if (!JpegEncoder_prepareScan(encoder, coefficients->width, coefficients->height)) return 0;
+
+    encoder->dctSource = coefficients;
+    encoder->width = coefficients->width;
+    encoder->height = coefficients->height;
+    JPEG_PROFILE_RESET(encoder);
+
+    int success = JpegEncoder_encodeScan(encoder, sink);
+    encoder->dctSource = NULL;
+    return success;
+}
+
+// ヘッダからEOIまでの出力（入力はframeまたはdctSource）
+static int JpegEncoder_encodeScan(JpegEncoder* encoder, JpegEncoder_Sink* sink) {
+    int mcuColumns = encoder->width / encoder->layout->mcuWidth;
+    int mcuCount = mcuColumns * (encoder->height / encoder->layout->mcuHeight);
+    if (encoder->optimizeHuffman) {
+        if (!JpegEncoder_optimizeHuffmanTables(encoder, mcuCount)) return 0;
+    } else if (!encoder->standardHuffman) {
+        JpegEncoder_setStandardHuffmanSpecs(encoder);
+        JpegEncoder_initHuffmanTables(encoder);
+    }
+
+    JpegEncoder_write_jpeg_header(encoder, sink);
+
+    int success = 1;
+    if (encoder->restartMCUs > 0 && encoder->threadCount > 1 && mcuCount > encoder->restartMCUs) {
+        success = JpegEncoder_encodeParallel(encoder, mcuCount, sink);
+    } else if (encoder->threadCount > 1 && encoder->parallelMode == JPEG_PARALLEL_SEGMENTS && mcuCount > mcuColumns) {
+        // リスタートインターバルで区切れない場合は、MCU行ごとに符号化してビット単位でつなげる
+        // （ここではRSTマーカーが入ることはない）
+        success = JpegEncoder_encodeSegments(encoder, mcuCount, sink);
+    } else if (encoder->threadCount > 1 && encoder->parallelMode == JPEG_PARALLEL_PIPELINE && !encoder->coefCache && mcuCount > JPEG_PIPELINE_BATCH) {
+        // 変換と符号化をステージに分けて並列化する
+        success = JpegEncoder_encodePipelined(encoder, mcuCount, sink);
+    } else {
+        JpegEncoder_ScanState state;
+        JpegEncoder_initScanState(&state);
+        JpegEncoder_encodeMCUs(encoder, &state, 0, mcuCount, sink);
+        JpegEncoder_flush_bitstring(&state.writer, sink);
+    }
+
+    JpegEncoder_write_word(0xFFD9, sink); // EOIマーカー
+    JPEG_PROFILE_MERGE(encoder);
+    JPEG_PROFILE_DUMP(encoder);
+
+    free(encoder->coefCache);
+    free(encoder->maskCache);
+    encoder->coefCache = NULL;
+    encoder->maskCache = NULL;
+
+    if (!success) return 0;
+    if (sink->overflow) {
+        fprintf(stderr, "Error: Output buffer is too small\n");
+        return 0;
+    }
+    return 1;
+}
+
+// 量子化前のDCT係数の計算
+// 結果は品質に依存しないので、JpegEncoder_encodeCoefficientsで任意の品質に使い回せる
+JpegEncoder_Coefficients* JpegEncoder_analyze(JpegEncoder* encoder, const unsigned char* rgbBuffer, int width, int height, int stride) {
+    JpegEncoder_Frame frame;
+    JpegEncoder_bgrFrame(&frame, rgbBuffer, width, height, stride);
+    return JpegEncoder_analyzeFrame(encoder, &frame);
+}
+
+// 任意の画素形式のフレームのDCT係数の計算
+JpegEncoder_Coefficients* JpegEncoder_analyzeFrame(JpegEncoder* encoder, const JpegEncoder_Frame* frame) {
+    if (!JpegEncoder_checkFrame(frame)) return NULL;
+    if (encoder->dctMethod != JPEG_DCT_FAST) {
+        fprintf(stderr, "Error: Coefficient analysis needs the fast DCT\n");
+        return NULL;
+    }
+    int width = frame->width;
+    int height = frame->height;
+    if (!JpegEncoder_prepareScan(encoder, width, height)) return NULL;
+
+    const JpegEncoder_Layout* layout = encoder->layout;
+    int mcuCount = (width / layout->mcuWidth) * (height / layout->mcuHeight);
+    int chroma = layout->blockCount > layout->yBlocks;
+    JpegEncoder_Coefficients* coefficients = (JpegEncoder_Coefficients*)calloc(1, sizeof(JpegEncoder_Coefficients));
+    if (coefficients) {
+        coefficients->yBlocks = (int16_t (*)[64])malloc(sizeof(int16_t[64]) * layout->yBlocks * (size_t)mcuCount);
+        if (chroma) {
+            coefficients->cbBlocks = (int16_t (*)[64])malloc(sizeof(int16_t[64]) * (size_t)mcuCount);
+            coefficients->crBlocks = (int16_t (*)[64])malloc(sizeof(int16_t[64]) * (size_t)mcuCount);
+        }
+    }
+    if (!coefficients || !coefficients->yBlocks || (chroma && (!coefficients->cbBlocks || !coefficients->crBlocks))) {
+        fprintf(stderr, "Error: Cannot allocate coefficient buffer\n");
+        JpegEncoder_freeCoefficients(coefficients);
+        return NULL;
+    }
+    coefficients->width = width;
+    coefficients->height = height;
+    coefficients->mcuCount = mcuCount;
+    coefficients->subsampling = encoder->subsampling;
+
+    encoder->frame = *frame;
+    encoder->frameRow = 0;
+    encoder->width = width;
+
+    for (int mcu = 0; mcu < mcuCount; mcu++) {
+        char blocks[JPEG_MAX_BLOCKS][64];
+        int32_t dct_data[64];
+
+        layout->convert(encoder, mcu, blocks);
+
+        // 高速DCTの出力は|x| < 2^14なので16bitで保存できる
+        int16_t* dest[JPEG_MAX_BLOCKS];
+        for (int i = 0; i < layout->yBlocks; i++) {
+            dest[i] = coefficients->yBlocks[(size_t)mcu * layout->yBlocks + i];
+        }
+        if (chroma) {
+            dest[layout->yBlocks] = coefficients->cbBlocks[mcu];
+            dest[layout->yBlocks + 1] = coefficients->crBlocks[mcu];
+        }
+        for (int i = 0; i < layout->blockCount; i++) {
+            int32_t dc;
+            if (JpegEncoder_flatBlockDC(blocks[i], encoder->flatThreshold, &dc)) {
+                memset(dest[i], 0, sizeof(int16_t[64]));
+                dest[i][0] = (int16_t)dc;
+                continue;
+            }
+            JpegEncoder_kernels.dct(blocks[i], dct_data);
+            for (int j = 0; j < 64; j++) dest[i][j] = (int16_t)dct_data[j];
+        }
+    }
+    encoder->frame.planes[0] = NULL;
+    return coefficients;
+}
+
+// DCT係数の解放
+void JpegEncoder_freeCoefficients(JpegEncoder_Coefficients* coefficients) {
+    if (!coefficients) return;
+    free(coefficients->yBlocks);
+    free(coefficients->cbBlocks);
+    free(coefficients->crBlocks);
+    free(coefficients);
+}
+
+// 保存済みの係数の量子化とジグザグ並べ替え
+static uint64_t JpegEncoder_requantize(const int16_t* dct_block, short* fdc_data, const uint32_t* quant_recip) {
+    int32_t dct_data[64];
+    short quant_data[64];
+
+    for (int i = 0; i < 64; i++) dct_data[i] = dct_block[i];
+    JPEG_PROFILE_BEGIN(quantizeStart);
+    JpegEncoder_kernels.quantize(dct_data, quant_data, quant_recip);
+    JPEG_PROFILE_END(quantizeStart, JPEG_STAGE_QUANTIZE);
+
+    JPEG_PROFILE_BEGIN(zigzagStart);
+    uint64_t nonzeroMask = JpegEncoder_kernels.zigzag(quant_data, fdc_data);
+    JPEG_PROFILE_END(zigzagStart, JPEG_STAGE_ZIGZAG);
+    return nonzeroMask;
+}
+
+// 目標サイズ以下に収まる最も高い品質でのエンコード
+// 品質を二分探索し、各試行は保存済みの係数の量子化とハフマン符号化だけで済ませる
+// 成功すると選んだ品質がエンコーダに設定され、*qualityにも返される
+// 収まる品質がない場合やエンコードに失敗した場合は、呼び出し前の品質に戻す
+int JpegEncoder_encodeToSize(JpegEncoder* encoder, const JpegEncoder_Coefficients* coefficients, size_t maxBytes, JpegEncoder_Sink* sink, int* quality) {
+    JpegEncoder_Sink trial, best;
+    JpegEncoder_initSink(&trial, NULL, 0);
+    JpegEncoder_initSink(&best, NULL, 0);
+
+    int savedQuality = encoder->quality;
+    int low = 1, high = 100, bestQuality = 0;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        trial.size = 0;
+        JpegEncoder_setQuality(encoder, mid);
+        if (!JpegEncoder_encodeCoefficients(encoder, coefficients, &trial)) {
+            bestQuality = -1;
+            break;
+        }
+
+        if (trial.size <= maxBytes) {
+            JpegEncoder_Sink swap = best;
+            best = trial;
+            trial = swap;
+            bestQuality = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+
+    int success = 0;
+    if (bestQuality == 0) {
+        fprintf(stderr, "Error: Cannot fit the image in %zu bytes\n", maxBytes);
+    } else if (bestQuality > 0) {
+        JpegEncoder_setQuality(encoder, bestQuality);
+        JpegEncoder_write(best.data, best.size, sink);
+        if (quality) *quality = bestQuality;
+        success = !sink->overflow;
+        if (!success) fprintf(stderr, "Error: Output buffer is too small\n");
+    }
+
+    if (!success) JpegEncoder_setQuality(encoder, savedQuality);
+
+    JpegEncoder_freeSink(&trial);
+    JpegEncoder_freeSink(&best);
+    return success;
+}
+
+// ストリーミングエンコードの開始（ヘッダを出力する）
+int JpegEncoder_beginStream(JpegEncoder* encoder, int width, int height, JpegEncoder_Sink* sink) {
+    if (encoder->optimizeHuffman) {
+        fprintf(stderr, "Error: Huffman table optimization needs the whole image\n");
+        return 0;
+    }
+    if (!JpegEncoder_prepareScan(encoder, width, height)) return 0;
+    if (!encoder->standardHuffman) {
+        JpegEncoder_setStandardHuffmanSpecs(encoder);
+        JpegEncoder_initHuffmanTables(encoder);
+    }
+
+    encoder->frame.planes[0] = NULL;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->nextRow = 0;
+    JpegEncoder_validateMCUCache(encoder, JPEG_PIXEL_BGR);
+    JpegEncoder_initScanState(&encoder->scan);
+    JPEG_PROFILE_RESET(encoder);
+
+    JpegEncoder_write_jpeg_header(encoder, sink);
+    return !sink->overflow;
+}
+
+// 16行分のストリップをエンコード
+// stripはストリップの一番上の行を指し、呼び出し後は再利用してよい
+int JpegEncoder_writeStrip(JpegEncoder* encoder, const unsigned char* strip, int stride, JpegEncoder_Sink* sink) {
+    if (!strip) {
+        fprintf(stderr, "Error: No strip data to encode\n");
+        return 0;
+    }
+    if (encoder->nextRow >= encoder->height) {
+        fprintf(stderr, "Error: Too many strips for image height %d\n", encoder->height);
+        return 0;
+    }
+
+    // MCUの高さが8のサブサンプリングでは、1つのストリップが2MCU行になる
+    int mcuColumns = encoder->width / encoder->layout->mcuWidth;
+    int firstMCU = (encoder->nextRow / encoder->layout->mcuHeight) * mcuColumns;
+    int lastMCU = firstMCU + mcuColumns * (16 / encoder->layout->mcuHeight);
+
+    JpegEncoder_bgrFrame(&encoder->frame, strip, encoder->width, 16, stride);
+    encoder->frameRow = encoder->nextRow;
+    JpegEncoder_encodeMCUs(encoder, &encoder->scan, firstMCU, lastMCU, sink);
+    encoder->frame.planes[0] = NULL;
+    encoder->nextRow += 16;
+    JPEG_PROFILE_MERGE(encoder);
+
+    if (sink->overflow) {
+        fprintf(stderr, "Error: Output buffer is too small\n");
+        return 0;
+    }
+    return 1;
+}
+
+// ストリーミングエンコードの終了（残りのビットとEOIを出力する）
+int JpegEncoder_endStream(JpegEncoder* encoder, JpegEncoder_Sink* sink) {
+    if (encoder->nextRow != encoder->height) {
+        fprintf(stderr, "Error: Only %d of %d lines were encoded\n", encoder->nextRow, encoder->height);
+        return 0;
+    }
+
+    JpegEncoder_flush_bitstring(&encoder->scan.writer, sink);
+    JpegEncoder_write_word(0xFFD9, sink); // EOIマーカー
+    JPEG_PROFILE_MERGE(encoder);
+    JPEG_PROFILE_DUMP(encoder);
+
+    if (sink->overflow) {
+        fprintf(stderr, "Error: Output buffer is too small\n");
+        return 0;
+    }
+    return 1;
+}
+
+// 符号化状態の初期化
+static void JpegEncoder_initScanState(JpegEncoder_ScanState* state) {
+    state->prev_DC_Y = 0;
+    state->prev_DC_Cb = 0;
+    state->prev_DC_Cr = 0;
+    state->writer.buffer = 0;
+    state->writer.freeBits = 64;
+    state->writer.stuffBytes = 1;
+}
+
+// MCUの範囲[firstMCU, lastMCU)をエンコード（サブサンプリングごとのMCUループに振り分ける）
+static void JpegEncoder_encodeMCUs(JpegEncoder* encoder, JpegEncoder_ScanState* state, int firstMCU, int lastMCU, JpegEncoder_Sink* sink) {
+    encoder->layout->encode(encoder, state, firstMCU, lastMCU, sink);
+}
+
+// サブサンプリングごとのMCU処理の生成
+// H, V: MCU内のYブロックの横と縦の数、CHROMA: 1ならCb/Crブロックを持つ
+// CONVERT: MCUの色空間変換（YはH*V個のブロックに、Cb/CrはH×Vピクセルを平均した8x8ブロックにする）
+//   BGR以外の入力はJpegEncoder_readFrameMCUで読み込む
+// ブロック数、MCUの大きさ、量子化テーブルの選択はすべて定数になるので、MCUループの中に分岐は残らない
+//
+// convertMCU: 1MCU分の色空間変換（blocksにはYブロック、Cb、Crの順に入る）
+// transformMCU: 1MCU分の色空間変換とDCT・量子化（coefにはジグザグ順の係数が入る）
+//   dctSourceがあれば、色空間変換とDCTを省いて保存済みの係数を量子化する
+//   MCUキャッシュに同じ入力画素のMCUがあれば、その係数をそのまま使う
+// huffmanMCU: 1MCU分のハフマン符号化
+// encodeMCUs: MCUの範囲[firstMCU, lastMCU)をエンコード
+//   リスタートインターバルの境界では、バイト境界まで書き出してRSTnマーカーを付け、DC予測値をリセットする
+#define JPEG_DEFINE_MCU(suffix, H, V, CHROMA, CONVERT) \
+static void JpegEncoder_convertMCU_##suffix(const JpegEncoder* encoder, int mcu, char (*blocks)[64]) { \
+    int mcuColumns = encoder->width / ((H) * 8); \
+    int xPos = (mcu % mcuColumns) * ((H) * 8); \
+    int yPos = (mcu / mcuColumns) * ((V) * 8) - encoder->frameRow; \
+    if (encoder->frame.format == JPEG_PIXEL_BGR) { \
+        CONVERT(encoder->frame.planes[0], blocks[0], blocks[(H) * (V)], blocks[(H) * (V) + 1], encoder->frame.strides[0], xPos, yPos); \
+    } else { \
+        JpegEncoder_readFrameMCU(&encoder->frame, blocks, xPos, yPos, (H), (V), (CHROMA)); \
+    } \
+} \
+\
+static inline void JpegEncoder_transformMCU_##suffix(JpegEncoder* encoder, int mcu, short (*coef)[64], uint64_t* mask) { \
+    const JpegEncoder_QuantTables* tables = encoder->quantTables; \
+    const JpegEncoder_Coefficients* source = encoder->dctSource; \
+\
+    if (source) { \
+        for (int i = 0; i < (H) * (V); i++) { \
+            mask[i] = JpegEncoder_requantize(source->yBlocks[(size_t)mcu * ((H) * (V)) + i], coef[i], tables->YRecip); \
+        } \
+        if (CHROMA) { \
+            mask[(H) * (V)] = JpegEncoder_requantize(source->cbBlocks[mcu], coef[(H) * (V)], tables->CbCrRecip); \
+            mask[(H) * (V) + 1] = JpegEncoder_requantize(source->crBlocks[mcu], coef[(H) * (V) + 1], tables->CbCrRecip); \
+        } \
+        return; \
+    } \
+\
+    JpegEncoder_MCUCache* cache = encoder->mcuCache; \
+    unsigned char key[JPEG_MCU_KEY_BYTES]; \
+    int keySize = 0; \
+    uint64_t hash = 0; \
+    if (cache) { \
+        keySize = JpegEncoder_gatherMCU(encoder, mcu, key); \
+        hash = JpegEncoder_hashMCU(key, keySize); \
+        if (JpegEncoder_lookupMCU(cache, hash, key, keySize, coef, mask, (H) * (V) + 2 * (CHROMA))) return; \
+    } \
+\
+    char blocks[JPEG_MAX_BLOCKS][64]; \
+    JPEG_PROFILE_BEGIN(convertStart); \
+    JpegEncoder_convertMCU_##suffix(encoder, mcu, blocks); \
+    JPEG_PROFILE_END(convertStart, JPEG_STAGE_CONVERT); \
+\
+    for (int i = 0; i < (H) * (V); i++) { \
+        mask[i] = JpegEncoder_transformBlock(encoder, blocks[i], coef[i], tables->YTable, tables->YRecip); \
+    } \
+    if (CHROMA) { \
+        mask[(H) * (V)] = JpegEncoder_transformBlock(encoder, blocks[(H) * (V)], coef[(H) * (V)], tables->CbCrTable, tables->CbCrRecip); \
+        mask[(H) * (V) + 1] = JpegEncoder_transformBlock(encoder, blocks[(H) * (V) + 1], coef[(H) * (V) + 1], tables->CbCrTable, tables->CbCrRecip); \
+    } \
+    if (cache) JpegEncoder_storeMCU(cache, hash, key, keySize, coef, mask, (H) * (V) + 2 * (CHROMA)); \
+} \
+\
+static inline void JpegEncoder_huffmanMCU_##suffix(JpegEncoder* encoder, JpegEncoder_ScanState* state, short (*coef)[64], const uint64_t* mask, JpegEncoder_Sink* sink) { \
+    JpegEncoder_BitWriter* writer = &state->writer; \
+\
+    for (int i = 0; i < (H) * (V); i++) { \
+        JpegEncoder_doHuffmanEncoding(coef[i], mask[i], &state->prev_DC_Y, encoder->Y_DC_Codes, encoder->Y_AC_Codes, writer, sink); \
+    } \
+    if (CHROMA) { \
+        JpegEncoder_doHuffmanEncoding(coef[(H) * (V)], mask[(H) * (V)], &state->prev_DC_Cb, encoder->CbCr_DC_Codes, encoder->CbCr_AC_Codes, writer, sink); \
+        JpegEncoder_doHuffmanEncoding(coef[(H) * (V) + 1], mask[(H) * (V) + 1], &state->prev_DC_Cr, encoder->CbCr_DC_Codes, encoder->CbCr_AC_Codes, writer, sink); \
+    } \
+} \
+\
+static void JpegEncoder_encodeMCUs_##suffix(JpegEncoder* encoder, JpegEncoder_ScanState* state, int firstMCU, int lastMCU, JpegEncoder_Sink* sink) { \
+    enum { BLOCKS = (H) * (V) + 2 * (CHROMA) }; \
+    int restartInterval = encoder->restartMCUs; \
+\
+    for (int mcu = firstMCU; mcu < lastMCU; mcu++) { \
+        if (restartInterval > 0 && mcu > 0 && mcu % restartInterval == 0) { \
+            JpegEncoder_flush_bitstring(&state->writer, sink); \
+            JpegEncoder_write_word(0xFFD0 + ((mcu / restartInterval - 1) & 7), sink); /* RSTnマーカー */ \
+            state->prev_DC_Y = state->prev_DC_Cb = state->prev_DC_Cr = 0; \
+        } \
+\
+        short coefData[BLOCKS][64]; \
+        uint64_t maskData[BLOCKS]; \
+        short (*coef)[64] = coefData; \
+        uint64_t* mask = maskData; \
+        if (encoder->coefCache) { \
+            coef = encoder->coefCache + (size_t)mcu * BLOCKS; \
+            mask = encoder->maskCache + (size_t)mcu * BLOCKS; \
+        } else { \
+            JpegEncoder_transformMCU_##suffix(encoder, mcu, coef, mask); \
+        } \
+\
+        JpegEncoder_huffmanMCU_##suffix(encoder, state, coef, mask, sink); \
+    } \
+}
+
+JPEG_DEFINE_MCU(420, 2, 2, 1, JpegEncoder_kernels.convert)
+JPEG_DEFINE_MCU(422, 2, 1, 1, JpegEncoder_kernels.convert422)
+JPEG_DEFINE_MCU(444, 1, 1, 1, JpegEncoder_kernels.convert444)
+JPEG_DEFINE_MCU(gray, 1, 1, 0, JpegEncoder_kernels.convertGray)
+
+// 1ブロック分のDCT・量子化
+// 平坦なブロックはDCTを省き、DC係数だけを量子化する（AC係数はすべて0になるのでEOBだけが符号化される）
+static uint64_t JpegEncoder_transformBlock(const JpegEncoder* encoder, const char* channel_data, short* fdc_data, const unsigned char* quant_table, const uint32_t* quant_recip) {
+    int32_t dc;
+    if (encoder->dctMethod == JPEG_DCT_FAST && JpegEncoder_flatBlockDC(channel_data, encoder->flatThreshold, &dc)) {
+        JPEG_PROFILE_COUNT(flatBlocks, 1);
+        return JpegEncoder_quantizeFlat(dc, fdc_data, quant_recip);
+    }
+    return JpegEncoder_foword_FDC(channel_data, fdc_data, quant_table, quant_recip, encoder->dctMethod);
+}
+
+// 平坦ブロックの判定
+// 画素値の最大と最小の差がthreshold以下なら1を返し、*dcに高速DCTのDC係数（画素値の合計）を入れる
+// 完全に一様なブロックでは高速DCTのAC係数はすべて0になるので、threshold = 0なら結果はDCTを通した場合と一致する
+static int JpegEncoder_flatBlockDC(const char* channel_data, int threshold, int32_t* dc) {
+    if (threshold < 0) return 0;
+
+    if (threshold == 0) {
+        // 8画素ずつ先頭の画素値と比べる
+        uint64_t first = (unsigned char)channel_data[0] * 0x0101010101010101ULL;
+        for (int i = 0; i < 64; i += 8) {
+            uint64_t word;
+            memcpy(&word, channel_data + i, 8);
+            if (word != first) return 0;
+        }
+        *dc = channel_data[0] * 64;
+        return 1;
+    }
+
+    int minValue = channel_data[0], maxValue = channel_data[0], sum = 0;
+    for (int i = 0; i < 64; i++) {
+        int value = channel_data[i];
+        minValue = value < minValue ? value : minValue;
+        maxValue = value > maxValue ? value : maxValue;
+        sum += value;
+    }
+    if (maxValue - minValue > threshold) return 0;
+    *dc = sum;
+    return 1;
+}
+
+// 平坦ブロックの量子化（JpegEncoder_Quantize_fastのDC係数と同じ丸め）
+static uint64_t JpegEncoder_quantizeFlat(int32_t dc, short* fdc_data, const uint32_t* quant_recip) {
+    int32_t sign = dc >> 31;
+    uint32_t ax = (uint32_t)((dc ^ sign) - sign + 4 + sign);
+    int32_t q = (int32_t)(((uint64_t)ax * quant_recip[0]) >> QUANT_RECIP_SHIFT);
+
+    memset(fdc_data, 0, sizeof(short[64]));
+    fdc_data[0] = (short)((q ^ sign) - sign);
+    return fdc_data[0] != 0;
+}
+
+// ハフマンテーブルの最適化
+// 全MCUの量子化済み係数を求めてcoefCacheに保存し、シンボルの出現頻度から最適なテーブルを作る
+// 符号化の際はcoefCacheの係数を使うので、DCTは1回で済む
+static int JpegEncoder_optimizeHuffmanTables(JpegEncoder* encoder, int mcuCount) {
+    const JpegEncoder_Layout* layout = encoder->layout;
+    encoder->coefCache = (short (*)[64])malloc(sizeof(short[64]) * layout->blockCount * (size_t)mcuCount);
+    encoder->maskCache = (uint64_t*)malloc(sizeof(uint64_t) * layout->blockCount * (size_t)mcuCount);
+    if (!encoder->coefCache || !encoder->maskCache) {
+        fprintf(stderr, "Error: Cannot allocate coefficient buffer\n");
+        free(encoder->coefCache);
+        free(encoder->maskCache);
+        encoder->coefCache = NULL;
+        encoder->maskCache = NULL;
+        return 0;
+    }
+
+    long dcFreq[2][12], acFreq[2][256];  // [0]: Y、[1]: CbCr
+    memset(dcFreq, 0, sizeof(dcFreq));
+    memset(acFreq, 0, sizeof(acFreq));
+
+    short prev_DC_Y = 0, prev_DC_Cb = 0, prev_DC_Cr = 0;
+
+    for (int mcu = 0; mcu < mcuCount; mcu++) {
+        short (*coef)[64] = encoder->coefCache + (size_t)mcu * layout->blockCount;
+        uint64_t* mask = encoder->maskCache + (size_t)mcu * layout->blockCount;
+        layout->transform(encoder, mcu, coef, mask);
+
+        // リスタートインターバルの境界ではDC予測値がリセットされる
+        if (encoder->restartMCUs > 0 && mcu % encoder->restartMCUs == 0) {
+            prev_DC_Y = prev_DC_Cb = prev_DC_Cr = 0;
+        }
+
+        for (int i = 0; i < layout->yBlocks; i++) {
+            JpegEncoder_countSymbols(coef[i], mask[i], &prev_DC_Y, dcFreq[0], acFreq[0]);
+        }
+        if (layout->components == 3) {
+            JpegEncoder_countSymbols(coef[layout->yBlocks], mask[layout->yBlocks], &prev_DC_Cb, dcFreq[1], acFreq[1]);
+            JpegEncoder_countSymbols(coef[layout->yBlocks + 1], mask[layout->yBlocks + 1], &prev_DC_Cr, dcFreq[1], acFreq[1]);
+        }
+    }
+
+    // グレースケールではCbCrのテーブルは出力しないので、標準テーブルのままにしておく
+    JpegEncoder_buildOptimalSpec(dcFreq[0], 12, &encoder->huffmanSpecs[JPEG_HUFFMAN_Y_DC]);
+    JpegEncoder_buildOptimalSpec(acFreq[0], 256, &encoder->huffmanSpecs[JPEG_HUFFMAN_Y_AC]);
+    if (layout->components == 3) {
+        JpegEncoder_buildOptimalSpec(dcFreq[1], 12, &encoder->huffmanSpecs[JPEG_HUFFMAN_CBCR_DC]);
+        JpegEncoder_buildOptimalSpec(acFreq[1], 256, &encoder->huffmanSpecs[JPEG_HUFFMAN_CBCR_AC]);
+    }
+    JpegEncoder_initHuffmanTables(encoder);
+    encoder->standardHuffman = 0;
+    return 1;
+}
+
+// シンボルの出現頻度の集計（JpegEncoder_doHuffmanEncodingと同じ順にシンボルを数える）
+static void JpegEncoder_countSymbols(const short* DU, uint64_t nonzeroMask, short* prevDC, long* dcFreq, long* acFreq) {
+    int dcDiff = (int)(DU[0] - *prevDC);
+    *prevDC = DU[0];
+    dcFreq[JpegEncoder_getBitCode(dcDiff).length]++;
+
+    uint64_t acMask = nonzeroMask & ~1ULL;
+    int lastPos = 0;
+
+    while (acMask) {
+        int i = __builtin_ctzll(acMask);
+        acMask &= acMask - 1;
+
+        int zeroCounts = i - lastPos - 1;
+        for (; zeroCounts >= 16; zeroCounts -= 16) {
+            acFreq[0xF0]++; // ZRL
+        }
+        acFreq[(zeroCounts << 4) | JpegEncoder_getBitCode(DU[i]).length]++;
+        lastPos = i;
+    }
+
+    if (lastPos != 63) {
+        acFreq[0x00]++; // EOB
+    }
+}
+
+// 出現頻度から符号長16bit以下の最適なハフマンテーブルを作る（JPEG規格 Annex K.2の手順）
+// すべて1の符号が出ないように、頻度1の予約シンボルを加えてから符号長を求める
+// 頻度の偏りが大きい（フィボナッチ数列に近い）と、制限前の符号長は32bitを超えてシンボル数近くまで伸びる
+static void JpegEncoder_buildOptimalSpec(const long* symbolFreq, int symbolCount, JpegEncoder_HuffmanSpec* spec) {
+    long freq[257];
+    int codeSize[257], others[257], bits[258];
+
+    for (int i = 0; i < 257; i++) {
+        freq[i] = i < symbolCount ? symbolFreq[i] : 0;
+        codeSize[i] = 0;
+        others[i] = -1;
+    }
+    freq[256] = 1;  // 予約シンボル
+    memset(bits, 0, sizeof(bits));
+
+    // 頻度の低い2つを順に併合して符号長を求める
+    for (;;) {
+        int c1 = -1, c2 = -1;
+        long v1 = 0, v2 = 0;
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && (c1 < 0 || freq[i] <= v1)) {
+                v1 = freq[i];
+                c1 = i;
+            }
+        }
+        for (int i = 0; i < 257; i++) {
+            if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= v2)) {
+                v2 = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0) break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        codeSize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codeSize[c1]++;
+        }
+        others[c1] = c2;
+
+        codeSize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codeSize[c2]++;
+        }
+    }
+
+    for (int i = 0; i < 257; i++) {
+        if (codeSize[i]) bits[codeSize[i]]++;
+    }
+
+    // 16bitを超える符号を短くする（葉を2つ上げて、短い葉を1つ下げる）
+    for (int i = 257; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0) j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+
+    // 予約シンボルの分を最長の符号長から除く
+    int longest = 16;
+    while (bits[longest] == 0) longest--;
+    bits[longest]--;
+
+    int count = 0;
+    for (int i = 1; i <= 16; i++) {
+        spec->bits[i - 1] = (unsigned char)bits[i];
+    }
+    for (int length = 1; length <= 257; length++) {
+        for (int symbol = 0; symbol < symbolCount; symbol++) {
+            if (codeSize[symbol] == length) spec->values[count++] = (unsigned char)symbol;
+        }
+    }
+    spec->count = count;
+}
+
+// 並列エンコードのワーカー
+// 作業単位を順に取り出し、それぞれ専用の出力先にエンコードする
+static void* JpegEncoder_encodeWorker(void* arg) {
+    JpegEncoder_Job* job = (JpegEncoder_Job*)arg;
+    for (;;) {
+        int chunk = __atomic_fetch_add(&job->nextChunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= job->chunkCount) break;
+
+        int firstMCU = chunk * job->mcusPerChunk;
+        int lastMCU = firstMCU + job->mcusPerChunk;
+        if (lastMCU > job->mcuCount) lastMCU = job->mcuCount;
+
+        // 作業単位はインターバルの境界から始まるので、新しい状態から符号化できる
+        JpegEncoder_ScanState state;
+        JpegEncoder_initScanState(&state);
+        JpegEncoder_encodeMCUs(job->encoder, &state, firstMCU, lastMCU, &job->sinks[chunk]);
+        JpegEncoder_flush_bitstring(&state.writer, &job->sinks[chunk]);
+    }
+    JPEG_PROFILE_MERGE(job->encoder);
+    return NULL;
+}
+
+// リスタートインターバル単位の並列エンコード
+// インターバルごとにDC予測とビット位置が独立しているので、結果を順に連結すればよい
+static int JpegEncoder_encodeParallel(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink) {
+    int intervalCount = (mcuCount + encoder->restartMCUs - 1) / encoder->restartMCUs;
+    int threadCount = encoder->threadCount < intervalCount ? encoder->threadCount : intervalCount;
+
+    // スレッド数の4倍程度に分割して負荷の偏りをならす
+    JpegEncoder_Job job;
+    job.encoder = encoder;
+    job.mcuCount = mcuCount;
+    job.chunkCount = threadCount * 4 < intervalCount ? threadCount * 4 : intervalCount;
+    job.mcusPerChunk = (intervalCount + job.chunkCount - 1) / job.chunkCount * encoder->restartMCUs;
+    job.chunkCount = (mcuCount + job.mcusPerChunk - 1) / job.mcusPerChunk;
+    job.nextChunk = 0;
+
+    job.sinks = (JpegEncoder_Sink*)malloc(sizeof(JpegEncoder_Sink) * job.chunkCount);
+    if (!job.sinks) {
+        fprintf(stderr, "Error: Cannot allocate worker threads\n");
+        return 0;
+    }
+    for (int i = 0; i < job.chunkCount; i++) {
+        JpegEncoder_initSink(&job.sinks[i], NULL, 0);
+    }
+
+    JpegEncoder_runWorkers(JpegEncoder_encodeWorker, &job, threadCount);
+
+    int success = 1;
+    for (int i = 0; i < job.chunkCount; i++) {
+        if (job.sinks[i].overflow) {
+            fprintf(stderr, "Error: Cannot allocate output buffer\n");
+            success = 0;
+        } else if (success) {
+            JpegEncoder_write(job.sinks[i].data, job.sinks[i].size, sink);
+        }
+        JpegEncoder_freeSink(&job.sinks[i]);
+    }
+
+    free(job.sinks);
+    return success;
+}
+
+// threadCount個のスレッドでworkerを実行し、すべて終わるまで待つ
+// 呼び出し元のスレッドもワーカーとして働く。スレッドを作れなかった分は残りのスレッドが処理する
+static void JpegEncoder_runWorkers(void* (*worker)(void*), void* arg, int threadCount) {
+    pthread_t* threads = threadCount > 1 ? (pthread_t*)malloc(sizeof(pthread_t) * (threadCount - 1)) : NULL;
+    int started = 0;
+    for (int i = 1; i < threadCount && threads; i++) {
+        if (pthread_create(&threads[started], NULL, worker, arg) != 0) break;
+        started++;
+    }
+    worker(arg);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// 行並列エンコードの1回目：区間ごとにバイト詰めなしでハフマン符号化する
+// 最初の区間以外は、先頭のMCUを変換・量子化するだけにして、2つ目以降のMCUのDC予測値をその係数から求める
+static void* JpegEncoder_segmentWorker(void* arg) {
+    JpegEncoder_SegmentJob* job = (JpegEncoder_SegmentJob*)arg;
+    JpegEncoder* encoder = job->encoder;
+    const JpegEncoder_Layout* layout = encoder->layout;
+    for (;;) {
+        int index = __atomic_fetch_add(&job->nextSegment, 1, __ATOMIC_RELAXED);
+        if (index >= job->segmentCount) break;
+
+        JpegEncoder_Segment* segment = &job->segments[index];
+        int firstMCU = index * job->mcusPerSegment;
+        int lastMCU = firstMCU + job->mcusPerSegment < job->mcuCount ? firstMCU + job->mcusPerSegment : job->mcuCount;
+
+        JpegEncoder_ScanState state;
+        JpegEncoder_initScanState(&state);
+        state.writer.stuffBytes = 0;
+        if (firstMCU > 0) {
+            if (encoder->coefCache) {
+                memcpy(segment->headCoef, encoder->coefCache + (size_t)firstMCU * layout->blockCount, sizeof(segment->headCoef[0]) * layout->blockCount);
+                memcpy(segment->headMask, encoder->maskCache + (size_t)firstMCU * layout->blockCount, sizeof(segment->headMask[0]) * layout->blockCount);
+            } else {
+                layout->transform(encoder, firstMCU, segment->headCoef, segment->headMask);
+            }
+            state.prev_DC_Y = segment->headCoef[layout->yBlocks - 1][0];
+            if (layout->components == 3) {
+                state.prev_DC_Cb = segment->headCoef[layout->yBlocks][0];
+                state.prev_DC_Cr = segment->headCoef[layout->yBlocks + 1][0];
+            }
+            firstMCU++;
+        }
+
+        JpegEncoder_encodeMCUs(encoder, &state, firstMCU, lastMCU, &segment->bits);
+        segment->bitLength = JpegEncoder_finishBits(&state.writer, &segment->bits);
+        segment->lastDC[0] = state.prev_DC_Y;
+        segment->lastDC[1] = state.prev_DC_Cb;
+        segment->lastDC[2] = state.prev_DC_Cr;
+    }
+    JPEG_PROFILE_MERGE(encoder);
+    return NULL;
+}
+
+// 区間の先頭のMCUのハフマン符号化（前の区間の1回目が終わり、DC予測値が決まってから行う）
+static void JpegEncoder_encodeSegmentHead(JpegEncoder* encoder, JpegEncoder_Segment* segment, const JpegEncoder_Segment* prev) {
+    JpegEncoder_ScanState state;
+    JpegEncoder_initScanState(&state);
+    state.writer.stuffBytes = 0;
+    state.prev_DC_Y = prev->lastDC[0];
+    state.prev_DC_Cb = prev->lastDC[1];
+    state.prev_DC_Cr = prev->lastDC[2];
+
+    encoder->layout->huffman(encoder, &state, segment->headCoef, segment->headMask, &segment->head);
+    segment->headLength = JpegEncoder_finishBits(&state.writer, &segment->head);
+    segment->bitLength += segment->headLength;
+}
+
+// バイト詰めなしのビット列の書き終わり（正確なビット長を返す）
+// JpegEncoder_readBitsが8バイト単位で読めるように末尾を0で埋める
+static size_t JpegEncoder_finishBits(JpegEncoder_BitWriter* writer, JpegEncoder_Sink* bits) {
+    size_t bitLength = bits->size * 8 + (size_t)(64 - writer->freeBits);
+    JpegEncoder_flush_bitstring(writer, bits);
+    if (JpegEncoder_reserveSink(bits, 8)) {
+        memset(bits->data + bits->size, 0, 8);
+    }
+    return bitLength;
+}
+
+// 行並列エンコードの2回目：区間をスキャン上のビット位置にずらしてバイト詰めする
+// 区間iの出力はバイト(bitOffset_i / 8)から(bitOffset_{i+1} / 8)の直前までで、
+// 先頭のバイトには前の区間の末尾のビットが入り、末尾の端数ビットは次の区間の出力に回す
+// 1ブロックは少なくとも2bit（DCとEOB）で、最後以外の区間は4ブロック以上にするので、端数ビットが区間の長さを超えることはない
+static void* JpegEncoder_mergeWorker(void* arg) {
+    JpegEncoder_SegmentJob* job = (JpegEncoder_SegmentJob*)arg;
+    for (;;) {
+        int index = __atomic_fetch_add(&job->nextSegment, 1, __ATOMIC_RELAXED);
+        if (index >= job->segmentCount) break;
+
+        JpegEncoder_Segment* segment = &job->segments[index];
+        JpegEncoder_BitWriter writer = { 0, 64, 1 };
+
+        int head = (int)(segment->bitOffset & 7);
+        if (head) {
+            const JpegEncoder_Segment* prev = segment - 1;
+            JpegEncoder_put_bits(&writer, JpegEncoder_segmentBits(prev, prev->bitLength - head, head), head, &segment->out);
+        }
+
+        size_t end = segment->bitLength;
+        if (index + 1 < job->segmentCount) end -= segment[1].bitOffset & 7;
+
+        size_t pos = 0;
+        for (; pos + 32 <= end; pos += 32) {
+            JpegEncoder_put_bits(&writer, JpegEncoder_segmentBits(segment, pos, 32), 32, &segment->out);
+        }
+        if (pos < end) {
+            JpegEncoder_put_bits(&writer, JpegEncoder_segmentBits(segment, pos, (int)(end - pos)), (int)(end - pos), &segment->out);
+        }
+        // 最後の区間以外はバイト境界で終わるので、0で埋められるのはスキャンの末尾だけ
+        JpegEncoder_flush_bitstring(&writer, &segment->out);
+    }
+    JPEG_PROFILE_MERGE(job->encoder);
+    return NULL;
+}
+
+// 行並列エンコード
+// MCU行の組ごとに独立に符号化し、ビット長の累積和で求めた位置につなげる
+// RSTマーカーを使わずに、逐次エンコードと同じ出力になる
+static int JpegEncoder_encodeSegments(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink) {
+    int mcuColumns = encoder->width / encoder->layout->mcuWidth;
+    int rowCount = mcuCount / mcuColumns;
+    int minRows = (4 + mcuColumns * encoder->layout->blockCount - 1) / (mcuColumns * encoder->layout->blockCount);
+
+    // スレッド数の4倍程度に分割して負荷の偏りをならす
+    JpegEncoder_SegmentJob job;
+    job.encoder = encoder;
+    job.mcuCount = mcuCount;
+    job.segmentCount = encoder->threadCount * 4 < rowCount / minRows ? encoder->threadCount * 4 : rowCount / minRows;
+    job.mcusPerSegment = (rowCount + job.segmentCount - 1) / job.segmentCount * mcuColumns;
+    job.segmentCount = (mcuCount + job.mcusPerSegment - 1) / job.mcusPerSegment;
+    int threadCount = encoder->threadCount < job.segmentCount ? encoder->threadCount : job.segmentCount;
+
+    job.segments = (JpegEncoder_Segment*)malloc(sizeof(JpegEncoder_Segment) * job.segmentCount);
+    if (!job.segments) {
+        fprintf(stderr, "Error: Cannot allocate worker threads\n");
+        return 0;
+    }
+    for (int i = 0; i < job.segmentCount; i++) {
+        JpegEncoder_initSink(&job.segments[i].head, NULL, 0);
+        job.segments[i].headLength = 0;
+        JpegEncoder_initSink(&job.segments[i].bits, NULL, 0);
+        JpegEncoder_initSink(&job.segments[i].out, NULL, 0);
+    }
+
+    job.nextSegment = 0;
+    JpegEncoder_runWorkers(JpegEncoder_segmentWorker, &job, threadCount);
+
+    int success = 1;
+    size_t bitOffset = 0;
+    for (int i = 0; i < job.segmentCount; i++) {
+        if (i > 0) JpegEncoder_encodeSegmentHead(encoder, &job.segments[i], &job.segments[i - 1]);
+        if (job.segments[i].head.overflow || job.segments[i].bits.overflow) success = 0;
+        job.segments[i].bitOffset = bitOffset;
+        bitOffset += job.segments[i].bitLength;
+    }
+
+    if (success) {
+        job.nextSegment = 0;
+        JpegEncoder_runWorkers(JpegEncoder_mergeWorker, &job, threadCount);
+    }
+
+    for (int i = 0; i < job.segmentCount; i++) {
+        if (job.segments[i].out.overflow) success = 0;
+        if (success) {
+            JpegEncoder_write(job.segments[i].out.data, job.segments[i].out.size, sink);
+        }
+        JpegEncoder_freeSink(&job.segments[i].head);
+        JpegEncoder_freeSink(&job.segments[i].bits);
+        JpegEncoder_freeSink(&job.segments[i].out);
+    }
+    free(job.segments);
+
+    if (!success) fprintf(stderr, "Error: Cannot allocate output buffer\n");
+    return success;
+}
+
+// ビット列のposビット目からcountビット（1～32）の読み出し
+// dataはposを含むバイトから8バイト読めること
+static uint32_t JpegEncoder_readBits(const unsigned char* data, size_t pos, int count) {
+    uint64_t word;
+    memcpy(&word, data + pos / 8, 8);
+    word = __builtin_bswap64(word);
+    return (uint32_t)((word << (pos & 7)) >> (64 - count));
+}
+
+// 区間のビット列（head、bitsの順につなげたもの）のposビット目からcountビット（1～32）の読み出し
+static uint32_t JpegEncoder_segmentBits(const JpegEncoder_Segment* segment, size_t pos, int count) {
+    size_t headLength = segment->headLength;
+    if (pos >= headLength) return JpegEncoder_readBits(segment->bits.data, pos - headLength, count);
+    if (pos + (size_t)count <= headLength) return JpegEncoder_readBits(segment->head.data, pos, count);
+
+    // headとbitsの境目をまたぐ場合
+    int headBits = (int)(headLength - pos);
+    uint32_t high = JpegEncoder_readBits(segment->head.data, pos, headBits);
+    return (high << (count - headBits)) | JpegEncoder_readBits(segment->bits.data, 0, count - headBits);
+}
+
+#ifdef JPEG_ENCODER_PROFILE
+// 計測用のタイマー（x86はrdtscのサイクル数、それ以外はナノ秒）
+static uint64_t JpegEncoder_readTimer(void) {
+#ifdef JPEG_ENCODER_X86
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// 処理段階の時間の加算（startはJpegEncoder_readTimerの値）
+static void JpegEncoder_addStageTime(int stage, uint64_t start) {
+    JpegEncoder_threadProfile.time[stage] += JpegEncoder_readTimer() - start;
+    JpegEncoder_threadProfile.calls[stage]++;
+}
+
+// このスレッドの計測値をエンコーダの集計に加えて、スレッドローカルの集計を0に戻す
+static void JpegEncoder_mergeProfile(JpegEncoder_Profile* profile) {
+    uint64_t* from = (uint64_t*)&JpegEncoder_threadProfile;
+    uint64_t* to = (uint64_t*)profile;
+    for (size_t i = 0; i < sizeof(JpegEncoder_Profile) / sizeof(uint64_t); i++) {
+        __atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+    memset(&JpegEncoder_threadProfile, 0, sizeof(JpegEncoder_threadProfile));
+}
+
+// 計測結果をJSON（1行）で標準エラー出力に書き出す
+static void JpegEncoder_dumpProfile(const JpegEncoder* encoder) {
+    static const char* stageNames[JPEG_STAGE_COUNT] = {
+        "convertColorSpace", "DCT", "Quantize", "ZigZag", "doHuffmanEncoding", "write_bitbuffer"
+    };
+    const JpegEncoder_Profile* profile = &encoder->profile;
+    long mcuCount = (long)(encoder->width / encoder->layout->mcuWidth) * (encoder->height / encoder->layout->mcuHeight);
+#ifdef JPEG_ENCODER_X86
+    const char* unit = "cycles";
+#else
+    const char* unit = "ns";
+#endif
+
+    fprintf(stderr, "{\"profile\": {\"width\": %d, \"height\": %d, \"mcus\": %ld, \"subsampling\": \"%s\", \"kernel\": \"%s\", \"unit\": \"%s\", \"stages\": {",
+            encoder->width, encoder->height, mcuCount, encoder->layout->name, JpegEncoder_kernels.name, unit);
+    for (int i = 0; i < JPEG_STAGE_COUNT; i++) {
+        fprintf(stderr, "%s\"%s\": {\"time\": %llu, \"calls\": %llu, \"per_call\": %.1f}", i ? ", " : "", stageNames[i],
+                (unsigned long long)profile->time[i], (unsigned long long)profile->calls[i],
+                profile->calls[i] ? (double)profile->time[i] / profile->calls[i] : 0.0);
+    }
+    fprintf(stderr, "}, \"blocks\": %llu, \"flat_blocks\": %llu, \"nonzero_per_block\": %.2f, \"bits_per_mcu\": %.1f, \"stuffed_bytes\": %llu}}\n",
+            (unsigned long long)profile->blocks, (unsigned long long)profile->flatBlocks,
+            profile->blocks ? (double)profile->nonzeroCoefficients / profile->blocks : 0.0,
+            mcuCount ? (double)profile->huffmanBits / mcuCount : 0.0,
+            (unsigned long long)profile->stuffedBytes);
+}
+#endif
+
+// パイプラインの変換ステージ（色空間変換・DCT・量子化）
+// 空いているスロットにJPEG_PIPELINE_BATCH個ずつMCUを変換して書き込む
+static void* JpegEncoder_pipelineWorker(void* arg) {
+    JpegEncoder_Pipeline* pipeline = (JpegEncoder_Pipeline*)arg;
+    JpegEncoder* encoder = pipeline->encoder;
+    const JpegEncoder_Layout* layout = encoder->layout;
+
+    for (int batch = 0; batch < pipeline->batchCount; batch++) {
+        // 符号化ステージがスロットを読み終えるのを待つ
+        for (int spins = 0; batch - __atomic_load_n(&pipeline->consumed, __ATOMIC_ACQUIRE) >= JPEG_PIPELINE_SLOTS; spins++) {
+            JpegEncoder_backoff(spins);
+        }
+
+        JpegEncoder_Batch* slot = &pipeline->slots[batch & (JPEG_PIPELINE_SLOTS - 1)];
+        int firstMCU = batch * JPEG_PIPELINE_BATCH;
+        int lastMCU = firstMCU + JPEG_PIPELINE_BATCH < pipeline->mcuCount ? firstMCU + JPEG_PIPELINE_BATCH : pipeline->mcuCount;
+        for (int mcu = firstMCU; mcu < lastMCU; mcu++) {
+            int i = (mcu - firstMCU) * layout->blockCount;
+            layout->transform(encoder, mcu, slot->coef + i, slot->mask + i);
+        }
+
+        __atomic_store_n(&pipeline->produced, batch + 1, __ATOMIC_RELEASE);
+    }
+    JPEG_PROFILE_MERGE(encoder);
+    return NULL;
+}
+
+// パイプライン並列エンコード
+// 変換ステージを別スレッドで動かし、呼び出し元のスレッドがハフマン符号化を行う
+// 符号化の順序は逐次エンコードと同じなので、出力も同じになる
+static int JpegEncoder_encodePipelined(JpegEncoder* encoder, int mcuCount, JpegEncoder_Sink* sink) {
+    JpegEncoder_Pipeline pipeline;
+    pipeline.encoder = encoder;
+    pipeline.mcuCount = mcuCount;
+    pipeline.batchCount = (mcuCount + JPEG_PIPELINE_BATCH - 1) / JPEG_PIPELINE_BATCH;
+    pipeline.produced = 0;
+    pipeline.consumed = 0;
+    pipeline.slots = (JpegEncoder_Batch*)malloc(sizeof(JpegEncoder_Batch) * JPEG_PIPELINE_SLOTS);
+    if (!pipeline.slots) {
+        fprintf(stderr, "Error: Cannot allocate pipeline buffer\n");
+        return 0;
+    }
+
+    JpegEncoder_ScanState state;
+    JpegEncoder_initScanState(&state);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, JpegEncoder_pipelineWorker, &pipeline) != 0) {
+        // スレッドを作れなければ逐次エンコードする
+        free(pipeline.slots);
+        JpegEncoder_encodeMCUs(encoder, &state, 0, mcuCount, sink);
+        JpegEncoder_flush_bitstring(&state.writer, sink);
+        return 1;
+    }
+
+    for (int batch = 0; batch < pipeline.batchCount; batch++) {
+        // 変換ステージがスロットを書き終えるのを待つ
+        for (int spins = 0; __atomic_load_n(&pipeline.produced, __ATOMIC_ACQUIRE) <= batch; spins++) {
+            JpegEncoder_backoff(spins);
+        }
+
+        JpegEncoder_Batch* slot = &pipeline.slots[batch & (JPEG_PIPELINE_SLOTS - 1)];
+        int count = mcuCount - batch * JPEG_PIPELINE_BATCH < JPEG_PIPELINE_BATCH ? mcuCount - batch * JPEG_PIPELINE_BATCH : JPEG_PIPELINE_BATCH;
+        for (int i = 0; i < count; i++) {
+            encoder->layout->huffman(encoder, &state, slot->coef + i * encoder->layout->blockCount, slot->mask + i * encoder->layout->blockCount, sink);
+        }
+
+        __atomic_store_n(&pipeline.consumed, batch + 1, __ATOMIC_RELEASE);
+    }
+    JpegEncoder_flush_bitstring(&state.writer, sink);
+
+    pthread_join(thread, NULL);
+    free(pipeline.slots);
+    return 1;
+}
+
+// 他方のステージを待つ間の待機（しばらく空回りしてから、CPUを明け渡す）
+static void JpegEncoder_backoff(int spins) {
+    if (spins < 256) {
+#ifdef JPEG_ENCODER_X86
+        _mm_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+// 出力先の初期化
+// bufferがNULLの場合は必要に応じて拡張するメモリバッファになる
+void JpegEncoder_initSink(JpegEncoder_Sink* sink, unsigned char* buffer, size_t capacity) {
+    sink->data = buffer;
+    sink->size = 0;
+    sink->capacity = buffer ? capacity : 0;
+    sink->growable = buffer == NULL;
+    sink->overflow = 0;
+}
+
+// 出力先の解放（拡張可能なバッファのみ）
+void JpegEncoder_freeSink(JpegEncoder_Sink* sink) {
+    if (sink->growable) {
+        free(sink->data);
+        sink->data = NULL;
+        sink->capacity = 0;
+    }
+    sink->size = 0;
+}
+
+// 書き込み領域の確保
+static int JpegEncoder_reserveSink(JpegEncoder_Sink* sink, size_t byteSize) {
+    if (sink->size + byteSize <= sink->capacity) return 1;
+    if (!sink->growable || sink->overflow) {
+        sink->overflow = 1;
+        return 0;
+    }
+
+    size_t capacity = sink->capacity ? sink->capacity : 65536;
+    while (capacity < sink->size + byteSize) capacity *= 2;
+
+    unsigned char* data = (unsigned char*)realloc(sink->data, capacity);
+    if (!data) {
+        sink->overflow = 1;
+        return 0;
+    }
+    sink->data = data;
+    sink->capacity = capacity;
+    return 1;
+}
+
+// ハフマンテーブルの計算
+static void JpegEncoder_computeHuffmanTable(const unsigned char* nr_codes, const unsigned char* std_table, BitString* huffman_table) {
+    int pos_in_table = 0;
+    unsigned short code_value = 0;
+
+    for (int k = 1; k <= 16; k++) {
+        for (int j = 1; j <= nr_codes[k - 1]; j++) {
+            huffman_table[std_table[pos_in_table]].value = code_value;
+            huffman_table[std_table[pos_in_table]].length = k;
+            pos_in_table++;
+            code_value++;
+        }
+        code_value <<= 1;
+    }
+}
+
+// ビットコードの取得
+// ビット長は先頭の0の数から求め、負の値は(1 << length) - 1を足して1の補数にする
+static BitString JpegEncoder_getBitCode(int value) {
+    BitString ret;
+    int sign = value >> 31;
+    unsigned v = (unsigned)((value ^ sign) - sign);
+    int length = 31 - __builtin_clz((v << 1) | 1);  // v == 0なら0
+
+    ret.value = value + (sign & ((1 << length) - 1));
+    ret.length = length;
+    return ret;
+}
+
+// バイト書き込み
+static void JpegEncoder_write_byte(unsigned char value, JpegEncoder_Sink* sink) {
+    if (!JpegEncoder_reserveSink(sink, 1)) return;
+    sink->data[sink->size++] = value;
+}
+
+// ワード書き込み
+static void JpegEncoder_write_word(unsigned short value, JpegEncoder_Sink* sink) {
+    if (!JpegEncoder_reserveSink(sink, 2)) return;
+    sink->data[sink->size++] = (unsigned char)(value >> 8);
+    sink->data[sink->size++] = (unsigned char)(value & 0xFF);
+}
+
+// 汎用書き込み
+static void JpegEncoder_write(const void* p, size_t byteSize, JpegEncoder_Sink* sink) {
+    if (!JpegEncoder_reserveSink(sink, byteSize)) return;
+    memcpy(sink->data + sink->size, p, byteSize);
+    sink->size += byteSize;
+}
+
+// ビットの追加
+// 1回に追加するのは32bit以下なので、あふれた場合も1回の書き出しで収まる
+static inline void JpegEncoder_put_bits(JpegEncoder_BitWriter* writer, uint32_t value, int length, JpegEncoder_Sink* sink) {
+    if (length < writer->freeBits) {
+        writer->buffer = (writer->buffer << length) | value;
+        writer->freeBits -= length;
+    } else {
+        int rest = length - writer->freeBits;
+        JpegEncoder_write_bitbuffer((writer->buffer << writer->freeBits) | ((uint64_t)value >> rest), writer->stuffBytes, sink);
+        writer->buffer = value;  // 出力済みの上位ビットは次の書き出しまでにシフトで押し出される
+        writer->freeBits = 64 - rest;
+    }
+}
+
+// 符号表の値の追加
+static inline void JpegEncoder_put_code(JpegEncoder_BitWriter* writer, uint32_t code, JpegEncoder_Sink* sink) {
+    JPEG_PROFILE_COUNT(huffmanBits, code & 31);
+    JpegEncoder_put_bits(writer, code >> 5, (int)(code & 31), sink);
+}
+
+// ハフマン符号化
+// 符号を中間配列に貯めずに、直接ビットアキュムレータに書き込む
+// nonzeroMaskのビットiはDU[i] != 0を表し、AC係数は非ゼロの位置だけを訪れる
+static void JpegEncoder_doHuffmanEncoding(const short* DU, uint64_t nonzeroMask, short* prevDC, const uint32_t* DCCodes, const uint32_t* ACCodes, JpegEncoder_BitWriter* writer, JpegEncoder_Sink* sink) {
+    JPEG_PROFILE_BEGIN(huffmanStart);
+    JPEG_PROFILE_COUNT(blocks, 1);
+    JPEG_PROFILE_COUNT(nonzeroCoefficients, __builtin_popcountll(nonzeroMask));
+
+    // DC係数の符号化
+    int dcDiff = (int)(DU[0] - *prevDC);
+    *prevDC = DU[0];
+    JpegEncoder_put_code(writer, DCCodes[dcDiff & 0xFFF], sink);
+
+    // AC係数の符号化（ゼロの連続長は次の非ゼロ係数の位置から求める）
+    uint64_t acMask = nonzeroMask & ~1ULL;
+    int lastPos = 0;
+
+    while (acMask) {
+        int i = __builtin_ctzll(acMask);
+        acMask &= acMask - 1;
+
+        int zeroCounts = i - lastPos - 1;
+        for (; zeroCounts >= 16; zeroCounts -= 16) {
+            JpegEncoder_put_code(writer, ACCodes[15 << 11], sink); // ZRL
+        }
+
+        JpegEncoder_put_code(writer, ACCodes[(zeroCounts << 11) | (DU[i] & 0x7FF)], sink);
+        lastPos = i;
+    }
+
+    if (lastPos != 63) {
+        JpegEncoder_put_code(writer, ACCodes[0], sink); // EOB
+    }
+    JPEG_PROFILE_END(huffmanStart, JPEG_STAGE_HUFFMAN);
+}
+
+// 64bit分のビットを8バイトまとめて書き出し
+// 0xFFを含む場合のみバイト単位で0x00を挿入する（stuffBytesが0なら挿入しない）
+static void JpegEncoder_write_bitbuffer(uint64_t buffer, int stuffBytes, JpegEncoder_Sink* sink) {
+    unsigned char bytes[16];
+    uint64_t inv = ~buffer;
+    JPEG_PROFILE_BEGIN(writeStart);
+
+    // 反転値に0x00のバイトがなければ0xFFは含まれない
+    if (!stuffBytes || ((inv - 0x0101010101010101ULL) & ~inv & 0x8080808080808080ULL) == 0) {
+        uint64_t be = __builtin_bswap64(buffer);
+        memcpy(bytes, &be, 8);
+        JpegEncoder_write(bytes, 8, sink);
+        JPEG_PROFILE_END(writeStart, JPEG_STAGE_WRITE);
+        return;
+    }
+
+    int n = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned char c = (unsigned char)(buffer >> (56 - 8 * i));
+        bytes[n++] = c;
+        if (c == 0xFF) bytes[n++] = 0x00;
+    }
+    JpegEncoder_write(bytes, n, sink);
+    JPEG_PROFILE_COUNT(stuffedBytes, n - 8);
+    JPEG_PROFILE_END(writeStart, JPEG_STAGE_WRITE);
+}
+
+// 残りのビットをバイト境界まで埋めて書き出し
+// スキャンに書き出す場合（stuffBytesが1）は、マーカーの前なので1で埋める（T.81 F.1.2.3）
+// 区間のビット列（stuffBytesが0）は、後でビット位置をずらしてつなげるので0で埋める
+static void JpegEncoder_flush_bitstring(JpegEncoder_BitWriter* writer, JpegEncoder_Sink* sink) {
+    int bits = 64 - writer->freeBits;
+    uint64_t buffer = bits ? writer->buffer << writer->freeBits : 0;
+    int padBits = -bits & 7;
+    if (writer->stuffBytes && padBits) {
+        buffer |= ((1ULL << padBits) - 1) << (64 - bits - padBits);
+    }
+    JPEG_PROFILE_BEGIN(writeStart);
+
+    for (int i = 0; i < (bits + 7) / 8; i++) {
+        unsigned char c = (unsigned char)(buffer >> (56 - 8 * i));
+        JpegEncoder_write_byte(c, sink);
+        if (c == 0xFF && writer->stuffBytes) {
+            JpegEncoder_write_byte(0x00, sink);
+            JPEG_PROFILE_COUNT(stuffedBytes, 1);
+        }
+    }
+    writer->buffer = 0;
+    writer->freeBits = 64;
+    JPEG_PROFILE_END(writeStart, JPEG_STAGE_WRITE);
+}
+
+// 色空間変換
+// 2x2ピクセルを一度だけ読み込み、4つのYと平均したCb/Crを同時に求める
+// Cb/Crは1ピクセルごとに>>8してから合計し、4で割る（0方向への切り捨て）
+static void JpegEncoder_convertColorSpace(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos) {
+    for (int y = 0; y < 8; y++) {
+        const unsigned char* row0 = rgbBuffer + (ptrdiff_t)(yPos + y * 2) * stride + xPos * 3;
+        const unsigned char* row1 = row0 + stride;
+        // 16x16の(2y, 2y+1)行が含まれるYブロックとその中の行
+        char* yRow = yData + (y >> 2) * 128 + (y * 2 & 7) * 8;
+
+        for (int x = 0; x < 8; x++) {
+            int cbSum = 0, crSum = 0;
+            for (int dy = 0; dy < 2; dy++) {
+                const unsigned char* p = (dy ? row1 : row0) + x * 6;
+                char* yOut = yRow + dy * 8 + (x >> 2) * 64 + (x * 2 & 7);
+                for (int dx = 0; dx < 2; dx++) {
+                    int B = p[dx * 3];
+                    int G = p[dx * 3 + 1];
+                    int R = p[dx * 3 + 2];
+                    yOut[dx] = (char)(((76 * R + 150 * G + 29 * B) >> 8) - 128);
+                    cbSum += (-43 * R - 85 * G + 128 * B) >> 8;
+                    crSum += (128 * R - 107 * G - 21 * B) >> 8;
+                }
+            }
+            cbData[y * 8 + x] = (char)(cbSum / 4);
+            crData[y * 8 + x] = (char)(crSum / 4);
+        }
+    }
+}
+
+// 色空間変換（4:2:2、4:4:4、グレースケール）
+// MCUの(H*8)x(V*8)ピクセルからH*V個のYブロックと、H×Vピクセルを平均した8x8のCb/Crブロックを求める
+// 平均の取り方は4:2:0と同じ（1ピクセルごとに>>8してから合計し、0方向に切り捨てて割る）
+// CHROMAが0ならYだけを求め、cbData/crDataには書き込まない
+#define JPEG_DEFINE_CONVERT(suffix, H, V, CHROMA) \
+static void JpegEncoder_convertColorSpace_##suffix(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos) { \
+    for (int y = 0; y < 8; y++) { \
+        for (int x = 0; x < 8; x++) { \
+            int cbSum = 0, crSum = 0; \
+            for (int dy = 0; dy < (V); dy++) { \
+                int row = y * (V) + dy; \
+                const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + row) * stride + (xPos + x * (H)) * 3; \
+                for (int dx = 0; dx < (H); dx++) { \
+                    int col = x * (H) + dx; \
+                    int B = p[dx * 3]; \
+                    int G = p[dx * 3 + 1]; \
+                    int R = p[dx * 3 + 2]; \
+                    yData[((row >> 3) * (H) + (col >> 3)) * 64 + (row & 7) * 8 + (col & 7)] = (char)(((76 * R + 150 * G + 29 * B) >> 8) - 128); \
+                    if (CHROMA) { \
+                        cbSum += (-43 * R - 85 * G + 128 * B) >> 8; \
+                        crSum += (128 * R - 107 * G - 21 * B) >> 8; \
+                    } \
+                } \
+            } \
+            if (CHROMA) { \
+                cbData[y * 8 + x] = (char)(cbSum / ((H) * (V))); \
+                crData[y * 8 + x] = (char)(crSum / ((H) * (V))); \
+            } \
+        } \
+    } \
+}
+
+JPEG_DEFINE_CONVERT(422, 2, 1, 1)
+JPEG_DEFINE_CONVERT(444, 1, 1, 1)
+JPEG_DEFINE_CONVERT(gray, 1, 1, 0)
+
+// 8バイトの画素値から128を引いてブロックの1行に写す
+static inline void JpegEncoder_copySigned8(const unsigned char* src, char* dst) {
+    uint64_t row;
+    memcpy(&row, src, 8);
+    row ^= 0x8080808080808080ULL;
+    memcpy(dst, &row, 8);
+}
+
+// BGR以外のフレームからの1MCU分の読み込み（H, V, chromaはJPEG_DEFINE_MCUの定数）
+// BGRX/RGBAはBGRと同じ式で色空間変換する
+// YUVは色空間変換をせずにYとU/Vから128を引いた値をそのまま使う
+// U/VがMCUのサブサンプリングより粗ければ同じ値を繰り返し、細かければ縦に平均する（0方向への切り捨て）
+// MCUループごとに展開してH, V, chromaを定数にする
+__attribute__((always_inline))
+static inline void JpegEncoder_readFrameMCU(const JpegEncoder_Frame* frame, char (*blocks)[64], int xPos, int yPos, int H, int V, int chroma) {
+    char* yData = blocks[0];
+    char* cbData = blocks[H * V];
+    char* crData = blocks[H * V + 1];
+
+    if (frame->format == JPEG_PIXEL_BGRX || frame->format == JPEG_PIXEL_RGBA) {
+        int bIndex = frame->format == JPEG_PIXEL_BGRX ? 0 : 2;
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                int cbSum = 0, crSum = 0;
+                for (int dy = 0; dy < V; dy++) {
+                    int row = y * V + dy;
+                    const unsigned char* p = frame->planes[0] + (ptrdiff_t)(yPos + row) * frame->strides[0] + (xPos + x * H) * 4;
+                    for (int dx = 0; dx < H; dx++) {
+                        int col = x * H + dx;
+                        int B = p[dx * 4 + bIndex];
+                        int G = p[dx * 4 + 1];
+                        int R = p[dx * 4 + 2 - bIndex];
+                        yData[((row >> 3) * H + (col >> 3)) * 64 + (row & 7) * 8 + (col & 7)] = (char)(((76 * R + 150 * G + 29 * B) >> 8) - 128);
+                        if (chroma) {
+                            cbSum += (-43 * R - 85 * G + 128 * B) >> 8;
+                            crSum += (128 * R - 107 * G - 21 * B) >> 8;
+                        }
+                    }
+                }
+                if (chroma) {
+                    cbData[y * 8 + x] = (char)(cbSum / (H * V));
+                    crData[y * 8 + x] = (char)(crSum / (H * V));
+                }
+            }
+        }
+        return;
+    }
+
+    // Y（YUYVでは2バイトおき）
+    // プレーンのYはブロックの1行が連続した8バイトなので、8バイトずつ128を引いて（最上位ビットの反転）写す
+    int yStep = frame->format == JPEG_PIXEL_YUYV ? 2 : 1;
+    for (int row = 0; row < V * 8; row++) {
+        const unsigned char* p = frame->planes[0] + (ptrdiff_t)(yPos + row) * frame->strides[0] + (ptrdiff_t)xPos * yStep;
+        char* yRow = yData + (row >> 3) * H * 64 + (row & 7) * 8;
+        if (yStep == 1) {
+            for (int bx = 0; bx < H; bx++) {
+                JpegEncoder_copySigned8(p + bx * 8, yRow + bx * 64);
+            }
+        } else {
+            for (int bx = 0; bx < H; bx++) {
+                for (int x = 0; x < 8; x++) yRow[bx * 64 + x] = (char)(p[(bx * 8 + x) * 2] - 128);
+            }
+        }
+    }
+    if (!chroma) return;
+
+    // U/Vの位置（u, vはプレーンの先頭、stepは横に隣り合う標本の間隔、subVは縦の間引き率）
+    const unsigned char* u;
+    const unsigned char* v;
+    int uStride, vStride, step, subV;
+    if (frame->format == JPEG_PIXEL_I420) {
+        u = frame->planes[1];
+        v = frame->planes[2];
+        uStride = frame->strides[1];
+        vStride = frame->strides[2];
+        step = 1;
+        subV = 2;
+    } else if (frame->format == JPEG_PIXEL_NV12) {
+        u = frame->planes[1];
+        v = frame->planes[1] + 1;
+        uStride = vStride = frame->strides[1];
+        step = 2;
+        subV = 2;
+    } else {
+        u = frame->planes[0] + 1;
+        v = frame->planes[0] + 3;
+        uStride = vStride = frame->strides[0];
+        step = 4;
+        subV = 1;
+    }
+
+    int rows = V > subV ? V / subV : 1;  // 平均するU/Vの行数
+    if (H == 2 && V == subV) {
+        // U/Vの標本化がMCUと同じ（I420/NV12の4:2:0、YUYVの4:2:2）なら、U/Vの1行がそのままブロックの1行になる
+        for (int y = 0; y < 8; y++) {
+            const unsigned char* uRow = u + (ptrdiff_t)(yPos / subV + y) * uStride + (ptrdiff_t)(xPos / 2) * step;
+            const unsigned char* vRow = v + (ptrdiff_t)(yPos / subV + y) * vStride + (ptrdiff_t)(xPos / 2) * step;
+            if (step == 1) {
+                JpegEncoder_copySigned8(uRow, cbData + y * 8);
+                JpegEncoder_copySigned8(vRow, crData + y * 8);
+            } else {
+                for (int x = 0; x < 8; x++) {
+                    cbData[y * 8 + x] = (char)(uRow[x * step] - 128);
+                    crData[y * 8 + x] = (char)(vRow[x * step] - 128);
+                }
+            }
+        }
+        return;
+    }
+    for (int y = 0; y < 8; y++) {
+        int sy = (yPos + y * V) / subV;
+        for (int x = 0; x < 8; x++) {
+            ptrdiff_t offset = (ptrdiff_t)((xPos + x * H) / 2) * step;
+            int cbSum = 0, crSum = 0;
+            for (int dy = 0; dy < rows; dy++) {
+                cbSum += u[(ptrdiff_t)(sy + dy) * uStride + offset] - 128;
+                crSum += v[(ptrdiff_t)(sy + dy) * vStride + offset] - 128;
+            }
+            cbData[y * 8 + x] = (char)(cbSum / rows);
+            crData[y * 8 + x] = (char)(crSum / rows);
+        }
+    }
+}
+
+// DCT処理
+// 各項は丸めずに積を足し合わせ、最後に一度だけ丸める（項ごとに丸めると64項分の誤差が積み重なる）
+static void JpegEncoder_DCT(const char* channel_data, int64_t* dct_data) {
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            int64_t temp = 0;
+            for (int x = 0; x < 8; x++) {
+                for (int y = 0; y < 8; y++) {
+                    int64_t data = channel_data[y * 8 + x];
+                    temp += data * cos_table[x][u] * cos_table[y][v];
+                }
+            }
+            dct_data[v * 8 + u] = (temp + (1LL << (2 * 14 - 1))) >> (2 * 14);
+        }
+    }
+}
+
+// 量子化処理
+static void JpegEncoder_Quantize(const int64_t* dct_data, short* quant_data, const unsigned char* quant_table) {
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            int alpha_u = (u == 0) ? 5793 : 8192; // 1/sqrt(2) * 8192
+            int alpha_v = (v == 0) ? 5793 : 8192;
+            int64_t temp = dct_data[v * 8 + u];
+            temp = (int)(((int64_t)temp * alpha_u * alpha_v + (1LL << (2 * 14 - 1))) >> (2 * 14));
+            quant_data[v * 8 + u] = (short)(temp / quant_table[ZigZag[v * 8 + u]]);
+        }
+    }
+}
+
+// 高速DCT処理（行列分離型、Loeffler方式）
+// 出力は正規化DCT係数の8倍になる
+static void JpegEncoder_DCT_fast(const char* channel_data, int32_t* dct_data) {
+    int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+    int32_t tmp10, tmp11, tmp12, tmp13;
+    int32_t z1, z2, z3, z4, z5;
+
+    // 1パス目：行方向（PASS1_BITSだけ精度を上げて保持）
+    for (int y = 0; y < 8; y++) {
+        const char* p = channel_data + y * 8;
+        int32_t* d = dct_data + y * 8;
+
+        tmp0 = p[0] + p[7];
+        tmp7 = p[0] - p[7];
+        tmp1 = p[1] + p[6];
+        tmp6 = p[1] - p[6];
+        tmp2 = p[2] + p[5];
+        tmp5 = p[2] - p[5];
+        tmp3 = p[3] + p[4];
+        tmp4 = p[3] - p[4];
+
+        // 偶数部
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        d[0] = (tmp10 + tmp11) * (1 << DCT_PASS1_BITS);
+        d[4] = (tmp10 - tmp11) * (1 << DCT_PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        d[2] = DCT_DESCALE(z1 + tmp13 * FIX_0_765366865, DCT_CONST_BITS - DCT_PASS1_BITS);
+        d[6] = DCT_DESCALE(z1 - tmp12 * FIX_1_847759065, DCT_CONST_BITS - DCT_PASS1_BITS);
+
+        // 奇数部
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        d[7] = DCT_DESCALE(tmp4 + z1 + z3, DCT_CONST_BITS - DCT_PASS1_BITS);
+        d[5] = DCT_DESCALE(tmp5 + z2 + z4, DCT_CONST_BITS - DCT_PASS1_BITS);
+        d[3] = DCT_DESCALE(tmp6 + z2 + z3, DCT_CONST_BITS - DCT_PASS1_BITS);
+        d[1] = DCT_DESCALE(tmp7 + z1 + z4, DCT_CONST_BITS - DCT_PASS1_BITS);
+    }
+
+    // 2パス目：列方向（PASS1_BITSを戻す）
+    for (int x = 0; x < 8; x++) {
+        int32_t* d = dct_data + x;
+
+        tmp0 = d[8 * 0] + d[8 * 7];
+        tmp7 = d[8 * 0] - d[8 * 7];
+        tmp1 = d[8 * 1] + d[8 * 6];
+        tmp6 = d[8 * 1] - d[8 * 6];
+        tmp2 = d[8 * 2] + d[8 * 5];
+        tmp5 = d[8 * 2] - d[8 * 5];
+        tmp3 = d[8 * 3] + d[8 * 4];
+        tmp4 = d[8 * 3] - d[8 * 4];
+
+        // 偶数部
+        tmp10 = tmp0 + tmp3;
+        tmp13 = tmp0 - tmp3;
+        tmp11 = tmp1 + tmp2;
+        tmp12 = tmp1 - tmp2;
+
+        d[8 * 0] = DCT_DESCALE(tmp10 + tmp11, DCT_PASS1_BITS);
+        d[8 * 4] = DCT_DESCALE(tmp10 - tmp11, DCT_PASS1_BITS);
+
+        z1 = (tmp12 + tmp13) * FIX_0_541196100;
+        d[8 * 2] = DCT_DESCALE(z1 + tmp13 * FIX_0_765366865, DCT_CONST_BITS + DCT_PASS1_BITS);
+        d[8 * 6] = DCT_DESCALE(z1 - tmp12 * FIX_1_847759065, DCT_CONST_BITS + DCT_PASS1_BITS);
+
+        // 奇数部
+        z1 = tmp4 + tmp7;
+        z2 = tmp5 + tmp6;
+        z3 = tmp4 + tmp6;
+        z4 = tmp5 + tmp7;
+        z5 = (z3 + z4) * FIX_1_175875602;
+
+        tmp4 *= FIX_0_298631336;
+        tmp5 *= FIX_2_053119869;
+        tmp6 *= FIX_3_072711026;
+        tmp7 *= FIX_1_501321110;
+        z1 *= -FIX_0_899976223;
+        z2 *= -FIX_2_562915447;
+        z3 = z3 * -FIX_1_961570560 + z5;
+        z4 = z4 * -FIX_0_390180644 + z5;
+
+        d[8 * 7] = DCT_DESCALE(tmp4 + z1 + z3, DCT_CONST_BITS + DCT_PASS1_BITS);
+        d[8 * 5] = DCT_DESCALE(tmp5 + z2 + z4, DCT_CONST_BITS + DCT_PASS1_BITS);
+        d[8 * 3] = DCT_DESCALE(tmp6 + z2 + z3, DCT_CONST_BITS + DCT_PASS1_BITS);
+        d[8 * 1] = DCT_DESCALE(tmp7 + z1 + z4, DCT_CONST_BITS + DCT_PASS1_BITS);
+    }
+}
+
+// 量子化テーブルの逆数計算
+// 量子化テーブルはDQTと同じジグザグ順、逆数は係数と同じ自然順で持つ
+// 高速DCTの8倍スケールも除数に含めておく
+static void JpegEncoder_initQuantRecip(const unsigned char* quant_table, uint32_t* quant_recip) {
+    for (int i = 0; i < 64; i++) {
+        uint32_t divisor = 8 * (uint32_t)quant_table[ZigZag[i]];
+        quant_recip[i] = (uint32_t)(((1ULL << QUANT_RECIP_SHIFT) + divisor - 1) / divisor);
+    }
+}
+
+// 高速DCT用の量子化処理（逆数乗算）
+// DCT_DESCALE(x, 3) / Q と同じ結果になるよう、丸めの加算値を符号で切り替える
+static void JpegEncoder_Quantize_fast(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip) {
+    for (int i = 0; i < 64; i++) {
+        int32_t x = dct_data[i];
+        int32_t sign = x >> 31;  // 負なら-1、それ以外は0
+        uint32_t ax = (uint32_t)((x ^ sign) - sign + 4 + sign);
+        int32_t q = (int32_t)(((uint64_t)ax * quant_recip[i]) >> QUANT_RECIP_SHIFT);
+        quant_data[i] = (short)((q ^ sign) - sign);
+    }
+}
+
+// ジグザグ処理
+static uint64_t JpegEncoder_ZigZag(const short* quant_data, short* fdc_data) {
+    uint64_t nonzeroMask = 0;
+    for (int v = 0; v < 8; v++) {
+        for (int u = 0; u < 8; u++) {
+            int zigZagIndex = ZigZag[v * 8 + u];
+            fdc_data[zigZagIndex] = quant_data[v * 8 + u];
+            nonzeroMask |= (uint64_t)(quant_data[v * 8 + u] != 0) << zigZagIndex;
+        }
+    }
+    return nonzeroMask;
+}
+
+#ifdef JPEG_ENCODER_X86
+// ジグザグ並べ替え用のpshufbマスク（JpegEncoder_initKernelsで生成）
+// 出力8要素ごとに、元データの各行から取り出す要素を指定する
+static __m128i ZigZag_Shuffle[8][8];
+static unsigned char ZigZag_ShuffleRows[8];  // 出力ごとに参照する行のビットマスク
+
+// 8x8（int32）の転置（AVX2）
+__attribute__((target("avx2")))
+static inline void JpegEncoder_transpose8x8_avx2(__m256i* r) {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// 1次元DCT（AVX2、レジスタ間で8列を同時に処理）
+// JpegEncoder_DCT_fastと同じ演算を同じ順序で行うため結果は一致する
+__attribute__((target("avx2")))
+static inline void JpegEncoder_DCT_1d_avx2(__m256i* d, int pass) {
+    const int shift_even = pass == 0 ? 0 : DCT_PASS1_BITS;
+    const int shift_odd = pass == 0 ? DCT_CONST_BITS - DCT_PASS1_BITS : DCT_CONST_BITS + DCT_PASS1_BITS;
+#define MUL(a, c) _mm256_mullo_epi32((a), _mm256_set1_epi32(c))
+#define DESCALE(a, n) _mm256_srai_epi32(_mm256_add_epi32((a), _mm256_set1_epi32(1 << ((n) - 1))), (n))
+    __m256i tmp0 = _mm256_add_epi32(d[0], d[7]);
+    __m256i tmp7 = _mm256_sub_epi32(d[0], d[7]);
+    __m256i tmp1 = _mm256_add_epi32(d[1], d[6]);
+    __m256i tmp6 = _mm256_sub_epi32(d[1], d[6]);
+    __m256i tmp2 = _mm256_add_epi32(d[2], d[5]);
+    __m256i tmp5 = _mm256_sub_epi32(d[2], d[5]);
+    __m256i tmp3 = _mm256_add_epi32(d[3], d[4]);
+    __m256i tmp4 = _mm256_sub_epi32(d[3], d[4]);
+
+    // 偶数部
+    __m256i tmp10 = _mm256_add_epi32(tmp0, tmp3);
+    __m256i tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+    __m256i tmp11 = _mm256_add_epi32(tmp1, tmp2);
+    __m256i tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+    if (pass == 0) {
+        d[0] = _mm256_slli_epi32(_mm256_add_epi32(tmp10, tmp11), DCT_PASS1_BITS);
+        d[4] = _mm256_slli_epi32(_mm256_sub_epi32(tmp10, tmp11), DCT_PASS1_BITS);
+    } else {
+        d[0] = DESCALE(_mm256_add_epi32(tmp10, tmp11), shift_even);
+        d[4] = DESCALE(_mm256_sub_epi32(tmp10, tmp11), shift_even);
+    }
+
+    __m256i z1 = MUL(_mm256_add_epi32(tmp12, tmp13), FIX_0_541196100);
+    d[2] = DESCALE(_mm256_add_epi32(z1, MUL(tmp13, FIX_0_765366865)), shift_odd);
+    d[6] = DESCALE(_mm256_sub_epi32(z1, MUL(tmp12, FIX_1_847759065)), shift_odd);
+
+    // 奇数部
+    z1 = _mm256_add_epi32(tmp4, tmp7);
+    __m256i z2 = _mm256_add_epi32(tmp5, tmp6);
+    __m256i z3 = _mm256_add_epi32(tmp4, tmp6);
+    __m256i z4 = _mm256_add_epi32(tmp5, tmp7);
+    __m256i z5 = MUL(_mm256_add_epi32(z3, z4), FIX_1_175875602);
+
+    tmp4 = MUL(tmp4, FIX_0_298631336);
+    tmp5 = MUL(tmp5, FIX_2_053119869);
+    tmp6 = MUL(tmp6, FIX_3_072711026);
+    tmp7 = MUL(tmp7, FIX_1_501321110);
+    z1 = MUL(z1, -FIX_0_899976223);
+    z2 = MUL(z2, -FIX_2_562915447);
+    z3 = _mm256_add_epi32(MUL(z3, -FIX_1_961570560), z5);
+    z4 = _mm256_add_epi32(MUL(z4, -FIX_0_390180644), z5);
+
+    d[7] = DESCALE(_mm256_add_epi32(_mm256_add_epi32(tmp4, z1), z3), shift_odd);
+    d[5] = DESCALE(_mm256_add_epi32(_mm256_add_epi32(tmp5, z2), z4), shift_odd);
+    d[3] = DESCALE(_mm256_add_epi32(_mm256_add_epi32(tmp6, z2), z3), shift_odd);
+    d[1] = DESCALE(_mm256_add_epi32(_mm256_add_epi32(tmp7, z1), z4), shift_odd);
+#undef MUL
+#undef DESCALE
+}
+
+// 高速DCT処理（AVX2）
+__attribute__((target("avx2")))
+static void JpegEncoder_DCT_avx2(const char* channel_data, int32_t* dct_data) {
+    __m256i d[8];
+
+    for (int y = 0; y < 8; y++) {
+        d[y] = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(channel_data + y * 8)));
+    }
+
+    // 行方向は転置してから列方向と同じ処理を行う
+    JpegEncoder_transpose8x8_avx2(d);
+    JpegEncoder_DCT_1d_avx2(d, 0);
+    JpegEncoder_transpose8x8_avx2(d);
+    JpegEncoder_DCT_1d_avx2(d, 1);
+
+    for (int v = 0; v < 8; v++) {
+        _mm256_storeu_si256((__m256i*)(dct_data + v * 8), d[v]);
+    }
+}
+
+// 量子化処理（AVX2）
+// 64bit積は偶数レーンと奇数レーンに分けて求める
+__attribute__((target("avx2")))
+static void JpegEncoder_Quantize_avx2(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip) {
+    const __m256i round = _mm256_set1_epi32(4);
+    __m256i q[2];
+
+    for (int i = 0; i < 64; i += 16) {
+        for (int j = 0; j < 2; j++) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(dct_data + i + j * 8));
+            __m256i r = _mm256_loadu_si256((const __m256i*)(quant_recip + i + j * 8));
+            __m256i a = _mm256_add_epi32(_mm256_abs_epi32(x), _mm256_add_epi32(round, _mm256_srai_epi32(x, 31)));
+
+            __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(a, r), QUANT_RECIP_SHIFT);
+            __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(r, 32));
+            odd = _mm256_slli_epi64(_mm256_srli_epi64(odd, QUANT_RECIP_SHIFT), 32);
+            q[j] = _mm256_sign_epi32(_mm256_blend_epi32(even, odd, 0xAA), x);
+        }
+
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xD8);
+        _mm256_storeu_si256((__m256i*)(quant_data + i), packed);
+    }
+}
+
+// 8x8（int32）の転置（SSE4.1、4x4単位）
+__attribute__((target("sse4.1")))
+static inline void JpegEncoder_transpose4x4_sse41(__m128i* a, __m128i* b, __m128i* c, __m128i* d) {
+    __m128i t0 = _mm_unpacklo_epi32(*a, *b);
+    __m128i t1 = _mm_unpackhi_epi32(*a, *b);
+    __m128i t2 = _mm_unpacklo_epi32(*c, *d);
+    __m128i t3 = _mm_unpackhi_epi32(*c, *d);
+    *a = _mm_unpacklo_epi64(t0, t2);
+    *b = _mm_unpackhi_epi64(t0, t2);
+    *c = _mm_unpacklo_epi64(t1, t3);
+    *d = _mm_unpackhi_epi64(t1, t3);
+}
+
+// r[2 * y + h]：y行目の左半分（h = 0）と右半分（h = 1）
+__attribute__((target("sse4.1")))
+static inline void JpegEncoder_transpose8x8_sse41(__m128i* r) {
+    JpegEncoder_transpose4x4_sse41(&r[0], &r[2], &r[4], &r[6]);
+    JpegEncoder_transpose4x4_sse41(&r[1], &r[3], &r[5], &r[7]);
+    JpegEncoder_transpose4x4_sse41(&r[8], &r[10], &r[12], &r[14]);
+    JpegEncoder_transpose4x4_sse41(&r[9], &r[11], &r[13], &r[15]);
+
+    // 右上と左下の4x4ブロックを入れ替える
+    for (int i = 0; i < 4; i++) {
+        __m128i t = r[2 * i + 1];
+        r[2 * i + 1] = r[2 * (i + 4)];
+        r[2 * (i + 4)] = t;
+    }
+}
+
+// 1次元DCT（SSE4.1、4列を同時に処理）
+__attribute__((target("sse4.1")))
+static inline void JpegEncoder_DCT_1d_sse41(__m128i* r, int h, int pass) {
+    const int shift_even = pass == 0 ? 0 : DCT_PASS1_BITS;
+    const int shift_odd = pass == 0 ? DCT_CONST_BITS - DCT_PASS1_BITS : DCT_CONST_BITS + DCT_PASS1_BITS;
+#define D(i) r[2 * (i) + h]
+#define MUL(a, c) _mm_mullo_epi32((a), _mm_set1_epi32(c))
+#define DESCALE(a, n) _mm_srai_epi32(_mm_add_epi32((a), _mm_set1_epi32(1 << ((n) - 1))), (n))
+    __m128i tmp0 = _mm_add_epi32(D(0), D(7));
+    __m128i tmp7 = _mm_sub_epi32(D(0), D(7));
+    __m128i tmp1 = _mm_add_epi32(D(1), D(6));
+    __m128i tmp6 = _mm_sub_epi32(D(1), D(6));
+    __m128i tmp2 = _mm_add_epi32(D(2), D(5));
+    __m128i tmp5 = _mm_sub_epi32(D(2), D(5));
+    __m128i tmp3 = _mm_add_epi32(D(3), D(4));
+    __m128i tmp4 = _mm_sub_epi32(D(3), D(4));
+
+    // 偶数部
+    __m128i tmp10 = _mm_add_epi32(tmp0, tmp3);
+    __m128i tmp13 = _mm_sub_epi32(tmp0, tmp3);
+    __m128i tmp11 = _mm_add_epi32(tmp1, tmp2);
+    __m128i tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+    if (pass == 0) {
+        D(0) = _mm_slli_epi32(_mm_add_epi32(tmp10, tmp11), DCT_PASS1_BITS);
+        D(4) = _mm_slli_epi32(_mm_sub_epi32(tmp10, tmp11), DCT_PASS1_BITS);
+    } else {
+        D(0) = DESCALE(_mm_add_epi32(tmp10, tmp11), shift_even);
+        D(4) = DESCALE(_mm_sub_epi32(tmp10, tmp11), shift_even);
+    }
+
+    __m128i z1 = MUL(_mm_add_epi32(tmp12, tmp13), FIX_0_541196100);
+    D(2) = DESCALE(_mm_add_epi32(z1, MUL(tmp13, FIX_0_765366865)), shift_odd);
+    D(6) = DESCALE(_mm_sub_epi32(z1, MUL(tmp12, FIX_1_847759065)), shift_odd);
+
+    // 奇数部
+    z1 = _mm_add_epi32(tmp4, tmp7);
+    __m128i z2 = _mm_add_epi32(tmp5, tmp6);
+    __m128i z3 = _mm_add_epi32(tmp4, tmp6);
+    __m128i z4 = _mm_add_epi32(tmp5, tmp7);
+    __m128i z5 = MUL(_mm_add_epi32(z3, z4), FIX_1_175875602);
+
+    tmp4 = MUL(tmp4, FIX_0_298631336);
+    tmp5 = MUL(tmp5, FIX_2_053119869);
+    tmp6 = MUL(tmp6, FIX_3_072711026);
+    tmp7 = MUL(tmp7, FIX_1_501321110);
+    z1 = MUL(z1, -FIX_0_899976223);
+    z2 = MUL(z2, -FIX_2_562915447);
+    z3 = _mm_add_epi32(MUL(z3, -FIX_1_961570560), z5);
+    z4 = _mm_add_epi32(MUL(z4, -FIX_0_390180644), z5);
+
+    D(7) = DESCALE(_mm_add_epi32(_mm_add_epi32(tmp4, z1), z3), shift_odd);
+    D(5) = DESCALE(_mm_add_epi32(_mm_add_epi32(tmp5, z2), z4), shift_odd);
+    D(3) = DESCALE(_mm_add_epi32(_mm_add_epi32(tmp6, z2), z3), shift_odd);
+    D(1) = DESCALE(_mm_add_epi32(_mm_add_epi32(tmp7, z1), z4), shift_odd);
+#undef D
+#undef MUL
+#undef DESCALE
+}
+
+// 高速DCT処理（SSE4.1）
+__attribute__((target("sse4.1")))
+static void JpegEncoder_DCT_sse41(const char* channel_data, int32_t* dct_data) {
+    __m128i r[16];
+
+    // ブロックはcharの配列なので、4画素ずつmemcpyで読み込む（境界の合っていないintとしては読まない）
+    for (int y = 0; y < 8; y++) {
+        int left, right;
+        memcpy(&left, channel_data + y * 8, 4);
+        memcpy(&right, channel_data + y * 8 + 4, 4);
+        r[2 * y] = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(left));
+        r[2 * y + 1] = _mm_cvtepi8_epi32(_mm_cvtsi32_si128(right));
+    }
+
+    JpegEncoder_transpose8x8_sse41(r);
+    JpegEncoder_DCT_1d_sse41(r, 0, 0);
+    JpegEncoder_DCT_1d_sse41(r, 1, 0);
+    JpegEncoder_transpose8x8_sse41(r);
+    JpegEncoder_DCT_1d_sse41(r, 0, 1);
+    JpegEncoder_DCT_1d_sse41(r, 1, 1);
+
+    for (int i = 0; i < 16; i++) {
+        _mm_storeu_si128((__m128i*)(dct_data + i * 4), r[i]);
+    }
+}
+
+// 量子化処理（SSE4.1）
+__attribute__((target("sse4.1")))
+static void JpegEncoder_Quantize_sse41(const int32_t* dct_data, short* quant_data, const uint32_t* quant_recip) {
+    const __m128i round = _mm_set1_epi32(4);
+    __m128i q[2];
+
+    for (int i = 0; i < 64; i += 8) {
+        for (int j = 0; j < 2; j++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(dct_data + i + j * 4));
+            __m128i r = _mm_loadu_si128((const __m128i*)(quant_recip + i + j * 4));
+            __m128i a = _mm_add_epi32(_mm_abs_epi32(x), _mm_add_epi32(round, _mm_srai_epi32(x, 31)));
+
+            __m128i even = _mm_srli_epi64(_mm_mul_epu32(a, r), QUANT_RECIP_SHIFT);
+            __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(r, 32));
+            odd = _mm_slli_epi64(_mm_srli_epi64(odd, QUANT_RECIP_SHIFT), 32);
+            q[j] = _mm_sign_epi32(_mm_blend_epi16(even, odd, 0xCC), x);
+        }
+
+        _mm_storeu_si128((__m128i*)(quant_data + i), _mm_packs_epi32(q[0], q[1]));
+    }
+}
+
+// ジグザグ処理（SSSE3のpshufbで行ごとに並べ替え）
+__attribute__((target("sse4.1")))
+static uint64_t JpegEncoder_ZigZag_sse41(const short* quant_data, short* fdc_data) {
+    __m128i row[8], out[8];
+
+    for (int v = 0; v < 8; v++) {
+        row[v] = _mm_loadu_si128((const __m128i*)(quant_data + v * 8));
+    }
+
+    for (int o = 0; o < 8; o++) {
+        out[o] = _mm_setzero_si128();
+        for (int v = 0; v < 8; v++) {
+            if (ZigZag_ShuffleRows[o] & (1 << v)) {
+                out[o] = _mm_or_si128(out[o], _mm_shuffle_epi8(row[v], ZigZag_Shuffle[o][v]));
+            }
+        }
+        _mm_storeu_si128((__m128i*)(fdc_data + o * 8), out[o]);
+    }
+
+    // 16係数ずつ0と比較してバイトにまとめ、movemaskでビットマスクにする
+    uint64_t zeroMask = 0;
+    for (int o = 0; o < 8; o += 2) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(out[o], zero), _mm_cmpeq_epi16(out[o + 1], zero));
+        zeroMask |= (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << (o * 8);
+    }
+    return ~zeroMask;
+}
+
+// 色空間変換（SSSE3のpshufbでBGRを分離し、16ピクセル×2行ずつ処理）
+// 1ピクセルのCb/Crは[-32640, 32640]なので16bitの乗算で誤差なく求まる
+__attribute__((target("sse4.1")))
+static void JpegEncoder_convertColorSpace_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos) {
+    // 48バイト（16ピクセル）からB, G, Rを取り出すマスク（3つのロードそれぞれ用）
+    const __m128i shufB0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufB1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i shufB2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i shufG0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufG1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i shufG2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i shufR0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufR1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i shufR2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i offset = _mm_set1_epi16(128);
+
+    for (int y = 0; y < 8; y++) {
+        __m128i cb[2], cr[2];  // 2行分の合計（左8ピクセル、右8ピクセル）
+
+        for (int dy = 0; dy < 2; dy++) {
+            int row = y * 2 + dy;
+            const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + row) * stride + xPos * 3;
+            __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+            __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+            __m128i b8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufB0), _mm_shuffle_epi8(v1, shufB1)), _mm_shuffle_epi8(v2, shufB2));
+            __m128i g8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufG0), _mm_shuffle_epi8(v1, shufG1)), _mm_shuffle_epi8(v2, shufG2));
+            __m128i r8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufR0), _mm_shuffle_epi8(v1, shufR1)), _mm_shuffle_epi8(v2, shufR2));
+
+            __m128i yv[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i B = h ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+                __m128i G = h ? _mm_unpackhi_epi8(g8, zero) : _mm_unpacklo_epi8(g8, zero);
+                __m128i R = h ? _mm_unpackhi_epi8(r8, zero) : _mm_unpacklo_epi8(r8, zero);
+
+                // Yの積和は最大65025で符号なし16bitに収まる
+                __m128i ysum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(76)), _mm_mullo_epi16(G, _mm_set1_epi16(150))),
+                                             _mm_mullo_epi16(B, _mm_set1_epi16(29)));
+                yv[h] = _mm_sub_epi16(_mm_srli_epi16(ysum, 8), offset);
+
+                __m128i cbv = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(-43)), _mm_mullo_epi16(G, _mm_set1_epi16(-85))),
+                                                           _mm_slli_epi16(B, 7)), 8);
+                __m128i crv = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(_mm_slli_epi16(R, 7), _mm_mullo_epi16(G, _mm_set1_epi16(107))),
+                                                           _mm_mullo_epi16(B, _mm_set1_epi16(21))), 8);
+                cb[h] = dy ? _mm_add_epi16(cb[h], cbv) : cbv;
+                cr[h] = dy ? _mm_add_epi16(cr[h], crv) : crv;
+            }
+
+            // 左8ピクセルは左のYブロック、右8ピクセルは右のYブロックへ
+            __m128i y8 = _mm_packs_epi16(yv[0], yv[1]);
+            char* yRow = yData + (row >> 3) * 128 + (row & 7) * 8;
+            _mm_storel_epi64((__m128i*)yRow, y8);
+            _mm_storel_epi64((__m128i*)(yRow + 64), _mm_unpackhi_epi64(y8, y8));
+        }
+
+        // 横の2ピクセルを合計し、0方向に切り捨てて4で割る
+        __m128i cbs = _mm_hadd_epi16(cb[0], cb[1]);
+        __m128i crs = _mm_hadd_epi16(cr[0], cr[1]);
+        cbs = _mm_srai_epi16(_mm_add_epi16(cbs, _mm_and_si128(_mm_srai_epi16(cbs, 15), _mm_set1_epi16(3))), 2);
+        crs = _mm_srai_epi16(_mm_add_epi16(crs, _mm_and_si128(_mm_srai_epi16(crs, 15), _mm_set1_epi16(3))), 2);
+        _mm_storel_epi64((__m128i*)(cbData + y * 8), _mm_packs_epi16(cbs, cbs));
+        _mm_storel_epi64((__m128i*)(crData + y * 8), _mm_packs_epi16(crs, crs));
+    }
+}
+
+// 色空間変換（4:2:2、SSE4.1。16ピクセルずつ1行ごとに処理）
+// 4:2:0のSIMD版と同じ計算で、Cb/Crは横の2ピクセルだけを平均する
+__attribute__((target("sse4.1")))
+static void JpegEncoder_convertColorSpace_422_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos) {
+    const __m128i shufB0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufB1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i shufB2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i shufG0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufG1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i shufG2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i shufR0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i shufR1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i shufR2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i offset = _mm_set1_epi16(128);
+
+    for (int y = 0; y < 8; y++) {
+        const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + y) * stride + xPos * 3;
+        __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(p + 32));
+
+        __m128i b8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufB0), _mm_shuffle_epi8(v1, shufB1)), _mm_shuffle_epi8(v2, shufB2));
+        __m128i g8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufG0), _mm_shuffle_epi8(v1, shufG1)), _mm_shuffle_epi8(v2, shufG2));
+        __m128i r8 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, shufR0), _mm_shuffle_epi8(v1, shufR1)), _mm_shuffle_epi8(v2, shufR2));
+
+        __m128i yv[2], cb[2], cr[2];  // 左8ピクセル、右8ピクセル
+        for (int h = 0; h < 2; h++) {
+            __m128i B = h ? _mm_unpackhi_epi8(b8, zero) : _mm_unpacklo_epi8(b8, zero);
+            __m128i G = h ? _mm_unpackhi_epi8(g8, zero) : _mm_unpacklo_epi8(g8, zero);
+            __m128i R = h ? _mm_unpackhi_epi8(r8, zero) : _mm_unpacklo_epi8(r8, zero);
+
+            __m128i ysum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(76)), _mm_mullo_epi16(G, _mm_set1_epi16(150))),
+                                         _mm_mullo_epi16(B, _mm_set1_epi16(29)));
+            yv[h] = _mm_sub_epi16(_mm_srli_epi16(ysum, 8), offset);
+            cb[h] = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(-43)), _mm_mullo_epi16(G, _mm_set1_epi16(-85))),
+                                                 _mm_slli_epi16(B, 7)), 8);
+            cr[h] = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(_mm_slli_epi16(R, 7), _mm_mullo_epi16(G, _mm_set1_epi16(107))),
+                                                 _mm_mullo_epi16(B, _mm_set1_epi16(21))), 8);
+        }
+
+        __m128i y8 = _mm_packs_epi16(yv[0], yv[1]);
+        _mm_storel_epi64((__m128i*)(yData + y * 8), y8);
+        _mm_storel_epi64((__m128i*)(yData + 64 + y * 8), _mm_unpackhi_epi64(y8, y8));
+
+        // 横の2ピクセルを合計し、0方向に切り捨てて2で割る
+        __m128i cbs = _mm_hadd_epi16(cb[0], cb[1]);
+        __m128i crs = _mm_hadd_epi16(cr[0], cr[1]);
+        cbs = _mm_srai_epi16(_mm_add_epi16(cbs, _mm_and_si128(_mm_srai_epi16(cbs, 15), _mm_set1_epi16(1))), 1);
+        crs = _mm_srai_epi16(_mm_add_epi16(crs, _mm_and_si128(_mm_srai_epi16(crs, 15), _mm_set1_epi16(1))), 1);
+        _mm_storel_epi64((__m128i*)(cbData + y * 8), _mm_packs_epi16(cbs, cbs));
+        _mm_storel_epi64((__m128i*)(crData + y * 8), _mm_packs_epi16(crs, crs));
+    }
+}
+
+// 色空間変換（4:4:4、グレースケール、SSE4.1。8ピクセルずつ1行ごとに処理）
+// 24バイトを16バイトと8バイトに分けて読み込み、pshufbでB, G, Rを16bitに広げる
+// CHROMAが0ならYだけを求める
+#define JPEG_DEFINE_CONVERT8_SSE41(suffix, CHROMA) \
+__attribute__((target("sse4.1"))) \
+static void JpegEncoder_convertColorSpace_##suffix##_sse41(const unsigned char* rgbBuffer, char* yData, char* cbData, char* crData, int stride, int xPos, int yPos) { \
+    const __m128i shufB0 = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, 12, -1, 15, -1, -1, -1, -1, -1); \
+    const __m128i shufB1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1); \
+    const __m128i shufG0 = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, 13, -1, -1, -1, -1, -1, -1, -1); \
+    const __m128i shufG1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1); \
+    const __m128i shufR0 = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, 14, -1, -1, -1, -1, -1, -1, -1); \
+    const __m128i shufR1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1); \
+    const __m128i offset = _mm_set1_epi16(128); \
+\
+    for (int y = 0; y < 8; y++) { \
+        const unsigned char* p = rgbBuffer + (ptrdiff_t)(yPos + y) * stride + xPos * 3; \
+        __m128i v0 = _mm_loadu_si128((const __m128i*)p); \
+        __m128i v1 = _mm_loadl_epi64((const __m128i*)(p + 16)); \
+        __m128i B = _mm_or_si128(_mm_shuffle_epi8(v0, shufB0), _mm_shuffle_epi8(v1, shufB1)); \
+        __m128i G = _mm_or_si128(_mm_shuffle_epi8(v0, shufG0), _mm_shuffle_epi8(v1, shufG1)); \
+        __m128i R = _mm_or_si128(_mm_shuffle_epi8(v0, shufR0), _mm_shuffle_epi8(v1, shufR1)); \
+\
+        __m128i ysum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(76)), _mm_mullo_epi16(G, _mm_set1_epi16(150))), \
+                                     _mm_mullo_epi16(B, _mm_set1_epi16(29))); \
+        __m128i yv = _mm_sub_epi16(_mm_srli_epi16(ysum, 8), offset); \
+        _mm_storel_epi64((__m128i*)(yData + y * 8), _mm_packs_epi16(yv, yv)); \
+\
+        if (CHROMA) { \
+            __m128i cbv = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(R, _mm_set1_epi16(-43)), _mm_mullo_epi16(G, _mm_set1_epi16(-85))), \
+                                                       _mm_slli_epi16(B, 7)), 8); \
+            __m128i crv = _mm_srai_epi16(_mm_sub_epi16(_mm_sub_epi16(_mm_slli_epi16(R, 7), _mm_mullo_epi16(G, _mm_set1_epi16(107))), \
+                                                       _mm_mullo_epi16(B, _mm_set1_epi16(21))), 8); \
+            _mm_storel_epi64((__m128i*)(cbData + y * 8), _mm_packs_epi16(cbv, cbv)); \
+            _mm_storel_epi64((__m128i*)(crData + y * 8), _mm_packs_epi16(crv, crv)); \
+        } \
+    } \
+}
+
+JPEG_DEFINE_CONVERT8_SSE41(444, 1)
+JPEG_DEFINE_CONVERT8_SSE41(gray, 0)
+#endif
+
+// 既定のカーネル選択（JpegEncoder_createから一度だけ呼ばれる）
+// 先にJpegEncoder_initKernelsで選択されていればそれを優先する
+static void JpegEncoder_initDefaultKernels(void) {
+    if (!JpegEncoder_kernels.dct) {
+        JpegEncoder_initKernels(NULL);
+    }
+}
+
+// 選択中のカーネル名
+const char* JpegEncoder_getKernelName(void) {
+    return JpegEncoder_kernels.name;
+}
+
+// ブロック処理カーネルの選択
+// kernelNameがNULLの場合はCPUがサポートする最速のカーネルを選ぶ
+int JpegEncoder_initKernels(const char* kernelName) {
+    static const JpegEncoder_Kernels scalar = { "scalar", JpegEncoder_convertColorSpace, JpegEncoder_convertColorSpace_422, JpegEncoder_convertColorSpace_444,
+                                               JpegEncoder_convertColorSpace_gray, JpegEncoder_DCT_fast, JpegEncoder_Quantize_fast, JpegEncoder_ZigZag };
+#ifdef JPEG_ENCODER_X86
+    static const JpegEncoder_Kernels sse41 = { "sse4.1", JpegEncoder_convertColorSpace_sse41, JpegEncoder_convertColorSpace_422_sse41, JpegEncoder_convertColorSpace_444_sse41,
+                                              JpegEncoder_convertColorSpace_gray_sse41, JpegEncoder_DCT_sse41, JpegEncoder_Quantize_sse41, JpegEncoder_ZigZag_sse41 };
+    static const JpegEncoder_Kernels avx2 = { "avx2", JpegEncoder_convertColorSpace_sse41, JpegEncoder_convertColorSpace_422_sse41, JpegEncoder_convertColorSpace_444_sse41,
+                                             JpegEncoder_convertColorSpace_gray_sse41, JpegEncoder_DCT_avx2, JpegEncoder_Quantize_avx2, JpegEncoder_ZigZag_sse41 };
+
+    // pshufbマスクの生成
+    memset(ZigZag_Shuffle, 0x80, sizeof(ZigZag_Shuffle));
+    memset(ZigZag_ShuffleRows, 0, sizeof(ZigZag_ShuffleRows));
+    for (int i = 0; i < 64; i++) {
+        int o = ZigZag[i] >> 3, pos = ZigZag[i] & 7;
+        int v = i >> 3, u = i & 7;
+        unsigned char* mask = (unsigned char*)&ZigZag_Shuffle[o][v];
+        mask[pos * 2] = (unsigned char)(u * 2);
+        mask[pos * 2 + 1] = (unsigned char)(u * 2 + 1);
+        ZigZag_ShuffleRows[o] |= (unsigned char)(1 << v);
+    }
+
+    __builtin_cpu_init();
+    int has_avx2 = __builtin_cpu_supports("avx2");
+    int has_sse41 = __builtin_cpu_supports("sse4.1");
+#else
+    int has_avx2 = 0, has_sse41 = 0;
+#endif
+
+    if (kernelName == NULL) {
+        kernelName = has_avx2 ? "avx2" : has_sse41 ? "sse4.1" : "scalar";
+    }
+
+    if (strcmp(kernelName, "scalar") == 0) {
+        JpegEncoder_kernels = scalar;
+#ifdef JPEG_ENCODER_X86
+    } else if (strcmp(kernelName, "sse4.1") == 0 && has_sse41) {
+        JpegEncoder_kernels = sse41;
+    } else if (strcmp(kernelName, "avx2") == 0 && has_avx2) {
+        JpegEncoder_kernels = avx2;
+#endif
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// DCTと量子化（整数演算版）
+// 戻り値はジグザグ順の非ゼロ係数のビットマスク（ビットiがfdc_data[i] != 0）
+static uint64_t JpegEncoder_foword_FDC(const char* channel_data, short* fdc_data, const unsigned char* quant_table, const uint32_t* quant_recip, int dctMethod) {
+    short quant_data[64];
+
+    if (dctMethod == JPEG_DCT_REFERENCE) {
+        int64_t dct_data[64];
+        JPEG_PROFILE_BEGIN(dctStart);
+        JpegEncoder_DCT(channel_data, dct_data);
+        JPEG_PROFILE_END(dctStart, JPEG_STAGE_DCT);
+        JPEG_PROFILE_BEGIN(quantizeStart);
+        JpegEncoder_Quantize(dct_data, quant_data, quant_table);
+        JPEG_PROFILE_END(quantizeStart, JPEG_STAGE_QUANTIZE);
+    } else {
+        int32_t dct_data[64];
+        JPEG_PROFILE_BEGIN(dctStart);
+        JpegEncoder_kernels.dct(channel_data, dct_data);
+        JPEG_PROFILE_END(dctStart, JPEG_STAGE_DCT);
+        JPEG_PROFILE_BEGIN(quantizeStart);
+        JpegEncoder_kernels.quantize(dct_data, quant_data, quant_recip);
+        JPEG_PROFILE_END(quantizeStart, JPEG_STAGE_QUANTIZE);
+    }
+
+    JPEG_PROFILE_BEGIN(zigzagStart);
+    uint64_t nonzeroMask = JpegEncoder_kernels.zigzag(quant_data, fdc_data);
+    JPEG_PROFILE_END(zigzagStart, JPEG_STAGE_ZIGZAG);
+    return nonzeroMask;
+}
+
+// JPEGヘッダ書き込み
+static void JpegEncoder_write_jpeg_header(JpegEncoder* encoder, JpegEncoder_Sink* sink) {
+    // SOI
+    JpegEncoder_write_word(0xFFD8, sink);
+
+    // APP0
+    JpegEncoder_write_word(0xFFE0, sink);
+    JpegEncoder_write_word(16, sink);
+    JpegEncoder_write("JFIF\0", 5, sink);
+    JpegEncoder_write_byte(1, sink);
+    JpegEncoder_write_byte(1, sink);
+    JpegEncoder_write_byte(0, sink);
+    JpegEncoder_write_word(1, sink);
+    JpegEncoder_write_word(1, sink);
+    JpegEncoder_write_byte(0, sink);
+    JpegEncoder_write_byte(0, sink);
+
+    // グレースケールではYの量子化テーブルとハフマンテーブルだけを出力する
+    int components = encoder->layout->components;
+    int tableCount = components == 3 ? 2 : 1;
+
+    // DQT
+    JpegEncoder_write_word(0xFFDB, sink);
+    JpegEncoder_write_word((unsigned short)(2 + 65 * tableCount), sink);
+    JpegEncoder_write_byte(0, sink);
+    JpegEncoder_write(encoder->quantTables->YTable, 64, sink);
+    if (components == 3) {
+        JpegEncoder_write_byte(1, sink);
+        JpegEncoder_write(encoder->quantTables->CbCrTable, 64, sink);
+    }
+
+    // SOF0
+    JpegEncoder_write_word(0xFFC0, sink);
+    JpegEncoder_write_word((unsigned short)(8 + 3 * components), sink);
+    JpegEncoder_write_byte(8, sink);
+    JpegEncoder_write_word(encoder->height & 0xFFFF, sink);
+    JpegEncoder_write_word(encoder->width & 0xFFFF, sink);
+    JpegEncoder_write_byte((unsigned char)components, sink);
+    JpegEncoder_write_byte(1, sink);
+    JpegEncoder_write_byte(encoder->layout->ySampling, sink);
+    JpegEncoder_write_byte(0, sink);
+    if (components == 3) {
+        JpegEncoder_write_byte(2, sink);
+        JpegEncoder_write_byte(0x11, sink);
+        JpegEncoder_write_byte(1, sink);
+        JpegEncoder_write_byte(3, sink);
+        JpegEncoder_write_byte(0x11, sink);
+        JpegEncoder_write_byte(1, sink);
+    }
+
+    // DHT
+    static const unsigned char huffmanClassIds[JPEG_HUFFMAN_TABLES] = { 0x00, 0x10, 0x01, 0x11 };
+    int huffmanCount = tableCount * 2;
+    int dhtLength = 2;
+    for (int i = 0; i < huffmanCount; i++) {
+        dhtLength += 1 + 16 + encoder->huffmanSpecs[i].count;
+    }
+    JpegEncoder_write_word(0xFFC4, sink);
+    JpegEncoder_write_word((unsigned short)dhtLength, sink);
+    for (int i = 0; i < huffmanCount; i++) {
+        JpegEncoder_write_byte(huffmanClassIds[i], sink);
+        JpegEncoder_write(encoder->huffmanSpecs[i].bits, 16, sink);
+        JpegEncoder_write(encoder->huffmanSpecs[i].values, encoder->huffmanSpecs[i].count, sink);
+    }
+
+    // DRI
+    if (encoder->restartMCUs > 0) {
+        JpegEncoder_write_word(0xFFDD, sink);
+        JpegEncoder_write_word(4, sink);
+        JpegEncoder_write_word((unsigned short)encoder->restartMCUs, sink);
+    }
+
+    // SOS
+    JpegEncoder_write_word(0xFFDA, sink);
+    JpegEncoder_write_word((unsigned short)(6 + 2 * components), sink);
+    JpegEncoder_write_byte((unsigned char)components, sink);
+    JpegEncoder_write_byte(1, sink);
+    JpegEncoder_write_byte(0, sink);
+    if (components == 3) {
+        JpegEncoder_write_byte(2, sink);
+        JpegEncoder_write_byte(0x11, sink);
+        JpegEncoder_write_byte(3, sink);
+        JpegEncoder_write_byte(0x11, sink);
+    }
+    JpegEncoder_write_byte(0, sink);
+    JpegEncoder_write_byte(0x3F, sink);
+    JpegEncoder_write_byte(0, sink);
+}
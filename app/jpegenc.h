@@ -0,0 +1,189 @@
+/*
+JPEG Encoder Library
+jpeg_encoder_3のエンコーダをライブラリ化したもの（4:2:0、4:2:2、4:4:4、グレースケール）
+*/
+#ifndef JPEGENC_H
+#define JPEGENC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// DCT方式
+typedef enum {
+    JPEG_DCT_FAST = 0,      // 行列分離型の高速整数DCT（Loeffler方式、32bit固定小数点）
+    JPEG_DCT_REFERENCE = 1  // 定義式どおりのDCT（検証用）
+} JpegEncoder_DCTMethod;
+
+// リスタートインターバルを1MCU行にする指定
+#define JPEG_RESTART_MCU_ROW (-1)
+
+// 出力先（メモリバッファ）
+typedef struct {
+    unsigned char* data;
+    size_t size;      // 書き込み済みバイト数
+    size_t capacity;  // dataの確保サイズ
+    int growable;     // 1: reallocで拡張する、0: 呼び出し側が用意した固定バッファ
+    int overflow;     // 固定バッファがあふれた、または拡張に失敗した
+} JpegEncoder_Sink;
+
+// 入力画像（BGR 24bit。JpegEncoder_readRawFrameではフレームのデータを保持する）
+typedef struct {
+    const unsigned char* data;  // 画像の一番上の行の先頭画素
+    int width;
+    int height;
+    int stride;                 // 行間のバイト数（下から上に格納された画像では負）
+    void* base;                 // マップしたファイル、または確保したバッファ
+    size_t baseSize;
+    int mapped;                 // 1: baseはmmapしたファイル
+} JpegEncoder_Image;
+
+// 入力フレームの画素形式
+typedef enum {
+    JPEG_PIXEL_BGR = 0,   // BGR 24bit（BMPと同じ並び）
+    JPEG_PIXEL_BGRX = 1,  // BGRX 32bit（Xは使わない）
+    JPEG_PIXEL_RGBA = 2,  // RGBA 32bit（Aは使わない）
+    JPEG_PIXEL_I420 = 3,  // Y、U、Vの3プレーン（U/Vは縦横1/2）
+    JPEG_PIXEL_NV12 = 4,  // YプレーンとUVを交互に並べたプレーン（UVは縦横1/2）
+    JPEG_PIXEL_YUYV = 5   // Y0 U Y1 Vの順に詰めた4:2:2の1プレーン
+} JpegEncoder_PixelFormat;
+
+// 入力フレーム
+// YUVはJFIFと同じフルレンジのYCbCrとみなし、色空間変換をせずにそのままブロックにする
+typedef struct {
+    int format;                      // JpegEncoder_PixelFormat
+    int width;
+    int height;
+    const unsigned char* planes[3];  // 各プレーンの一番上の行（I420はY, U, V、NV12はY, UV、それ以外は[0]のみ）
+    int strides[3];                  // 各プレーンの行間のバイト数（下から上に格納されたプレーンでは負）
+} JpegEncoder_Frame;
+
+// ストリップ単位で読み込むBMPファイル
+typedef struct {
+    FILE* fp;
+    int width;
+    int height;
+    int topDown;      // 1: 上の行から格納されている
+    long dataOffset;  // 画素データの先頭位置
+    int rowSize;      // ファイル上の1行のバイト数（4バイト境界）
+} JpegEncoder_BMPStream;
+
+// 量子化前のDCT係数（JpegEncoder_analyzeで作る）
+typedef struct JpegEncoder_Coefficients JpegEncoder_Coefficients;
+
+// エンコーダ（ハフマンテーブル、量子化テーブルを保持する）
+typedef struct JpegEncoder JpegEncoder;
+
+// エンコーダの生成と破棄
+// テーブルは生成時に一度だけ作られ、以降のエンコードで使い回される
+JpegEncoder* JpegEncoder_create(void);
+void JpegEncoder_destroy(JpegEncoder* encoder);
+void JpegEncoder_setDCTMethod(JpegEncoder* encoder, int dctMethod);
+
+// 品質の設定（1～100、大きいほど高画質、既定は75）
+// 量子化テーブルは品質ごとに一度だけ計算され、すべてのエンコーダで共有される
+int JpegEncoder_setQuality(JpegEncoder* encoder, int quality);
+
+// リスタートインターバル（DRI/RSTn）の設定
+// restartIntervalはMCU数で、0なら無効（既定）、JPEG_RESTART_MCU_ROWなら1MCU行ごと
+// 有効な場合、インターバルごとにthreadCount個のスレッドで並列にエンコードする
+// 無効な場合でもthreadCountが2以上なら、parallelModeの方法で並列にエンコードする
+int JpegEncoder_setRestartInterval(JpegEncoder* encoder, int restartInterval);
+int JpegEncoder_setThreadCount(JpegEncoder* encoder, int threadCount);
+
+// リスタートインターバルがない場合の並列化の方法（出力はどちらも1スレッドの場合と同じ）
+enum {
+    JPEG_PARALLEL_SEGMENTS = 0,  // MCU行の組ごとに符号化し、ビット単位でつなげる（既定）
+    JPEG_PARALLEL_PIPELINE = 1   // 色空間変換・DCT・量子化とハフマン符号化を2つのスレッドで分担する
+};
+void JpegEncoder_setParallelMode(JpegEncoder* encoder, int parallelMode);
+
+// 平坦ブロックの判定幅（既定は0）
+// 画素値の最大と最小の差がthreshold以下の8x8ブロックはDCTを省き、DC係数だけを符号化する
+// 0なら完全に一様なブロックのみで出力は変わらない。1以上ではAC係数を捨てるため画質が落ちる
+// JPEG_FLAT_BLOCKS_OFFなら常にDCTを行う。高速DCTでのみ有効
+#define JPEG_FLAT_BLOCKS_OFF (-1)
+int JpegEncoder_setFlatBlockThreshold(JpegEncoder* encoder, int threshold);
+
+// クロマサブサンプリング（既定は4:2:0）
+// 方式ごとにMCUのブロック構成を定数にした専用のMCUループでエンコードする
+enum {
+    JPEG_SUBSAMPLING_420 = 0,  // MCUは16x16（Y 4ブロック、Cb、Cr）
+    JPEG_SUBSAMPLING_422 = 1,  // MCUは16x8（Y 2ブロック、Cb、Cr）
+    JPEG_SUBSAMPLING_444 = 2,  // MCUは8x8（Y、Cb、Cr）
+    JPEG_SUBSAMPLING_GRAY = 3  // 輝度のみの1成分（MCUは8x8のY）
+};
+int JpegEncoder_setSubsampling(JpegEncoder* encoder, int subsampling);
+
+// エンコード済みMCUのキャッシュ（画面キャプチャなど、前のフレームや同じフレーム内で同じMCUが繰り返す入力向け）
+// MCUの入力画素のハッシュで量子化済み係数を引き、一致したMCUは色空間変換・DCT・量子化を省いてハフマン符号化だけを行う
+// entriesは保持するMCU数の上限（1項目あたり約2KB）で、あふれたら最も長く使われていないものから捨てる（0で無効、既定）
+// 出力はキャッシュを使わない場合と同じ。品質、サブサンプリングなどが変わると保持していた係数は捨てられる
+typedef struct {
+    size_t hits;       // キャッシュの係数を使ったMCU数
+    size_t misses;     // 変換してキャッシュに追加したMCU数
+    size_t evictions;  // あふれて捨てた項目数
+    int entries;       // 保持している項目数
+} JpegEncoder_MCUCacheStats;
+int JpegEncoder_setMCUCache(JpegEncoder* encoder, int entries);
+void JpegEncoder_getMCUCacheStats(const JpegEncoder* encoder, JpegEncoder_MCUCacheStats* stats);
+
+// ハフマンテーブルの最適化（0: Annex Kの標準テーブル（既定）、1: 画像ごとに最適化）
+// 最適化する場合は全MCUの量子化済み係数を保持するため、画像1枚分程度のメモリを使う
+// ストリーミングエンコードでは使えない
+void JpegEncoder_setOptimizeHuffman(JpegEncoder* encoder, int optimize);
+
+// エンコード
+// rgbBufferは画像の一番上の行を指し、strideは行間のバイト数
+// 幅と高さは16の倍数であること
+int JpegEncoder_encode(JpegEncoder* encoder, const unsigned char* rgbBuffer, int width, int height, int stride, JpegEncoder_Sink* sink);
+// frameはBGR以外の画素形式も指定できる（大きさは16の倍数であること）
+int JpegEncoder_encodeFrame(JpegEncoder* encoder, const JpegEncoder_Frame* frame, JpegEncoder_Sink* sink);
+void JpegEncoder_bgrFrame(JpegEncoder_Frame* frame, const unsigned char* rgbBuffer, int width, int height, int stride);
+
+// DCT係数を保存しておき、品質を変えて何度もエンコードする
+// 2回目以降は色空間変換とDCTを省き、量子化とハフマン符号化だけを行う（高速DCTのみ）
+// 係数は解析時のサブサンプリングでしかエンコードできない
+JpegEncoder_Coefficients* JpegEncoder_analyze(JpegEncoder* encoder, const unsigned char* rgbBuffer, int width, int height, int stride);
+JpegEncoder_Coefficients* JpegEncoder_analyzeFrame(JpegEncoder* encoder, const JpegEncoder_Frame* frame);
+int JpegEncoder_encodeCoefficients(JpegEncoder* encoder, const JpegEncoder_Coefficients* coefficients, JpegEncoder_Sink* sink);
+int JpegEncoder_encodeToSize(JpegEncoder* encoder, const JpegEncoder_Coefficients* coefficients, size_t maxBytes, JpegEncoder_Sink* sink, int* quality);
+void JpegEncoder_freeCoefficients(JpegEncoder_Coefficients* coefficients);
+
+// ストリーミングエンコード
+// 16行ずつのストリップ（4:2:0では1MCU行、それ以外では2MCU行）を上から順に渡すと、その場で符号化して出力先に追記する
+// 必要なメモリは画像の幅にのみ比例する（並列化は行わない、入力はBGRのみ）
+int JpegEncoder_beginStream(JpegEncoder* encoder, int width, int height, JpegEncoder_Sink* sink);
+int JpegEncoder_writeStrip(JpegEncoder* encoder, const unsigned char* strip, int stride, JpegEncoder_Sink* sink);
+int JpegEncoder_endStream(JpegEncoder* encoder, JpegEncoder_Sink* sink);
+
+// 出力先
+// bufferがNULLの場合は必要に応じて拡張するメモリバッファになる
+void JpegEncoder_initSink(JpegEncoder_Sink* sink, unsigned char* buffer, size_t capacity);
+void JpegEncoder_freeSink(JpegEncoder_Sink* sink);
+int JpegEncoder_writeSink(const JpegEncoder_Sink* sink, const char* fileName);
+int JpegEncoder_drainSink(JpegEncoder_Sink* sink, int fd);
+
+// ブロック処理カーネルの選択（NULLならCPUに合わせて自動選択）
+int JpegEncoder_initKernels(const char* kernelName);
+const char* JpegEncoder_getKernelName(void);
+
+// BMPファイルの読み込み
+int JpegEncoder_readFromBMP(JpegEncoder_Image* image, const char* fileName);
+
+// ヘッダのない生のフレームファイルの読み込み（プレーンは行間を詰めて順に並んでいること）
+// frameはimageが保持するデータを指すので、使い終わったらJpegEncoder_freeImageで解放する
+int JpegEncoder_readRawFrame(JpegEncoder_Image* image, JpegEncoder_Frame* frame, const char* fileName, int format, int width, int height);
+void JpegEncoder_freeImage(JpegEncoder_Image* image);
+int JpegEncoder_openBMPStream(JpegEncoder_BMPStream* stream, const char* fileName);
+int JpegEncoder_readBMPStrip(JpegEncoder_BMPStream* stream, int yPos, int lines, unsigned char* strip);
+void JpegEncoder_closeBMPStream(JpegEncoder_BMPStream* stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif